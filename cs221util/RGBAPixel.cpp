@@ -86,7 +86,7 @@ namespace cs221util {
    *
    * @param other the other RGBAPixel to compare to this one
    */
-  double RGBAPixel::distanceTo(RGBAPixel other) {
+  double RGBAPixel::distanceTo(const RGBAPixel& other) const {
       // this pixel's color channels
       double r_this = (r / 255.0) * a;
       double g_this = (g / 255.0) * a;
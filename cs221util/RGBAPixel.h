@@ -64,7 +64,7 @@ namespace cs221util {
      * 
      * @param other the other RGBAPixel to compare to this one
      */
-    double distanceTo(RGBAPixel other);
+    double distanceTo(const RGBAPixel& other) const;
   };
 
   /**
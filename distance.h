@@ -0,0 +1,257 @@
+/**
+ * @file distance.h
+ * @description colour distance policies for QTree::Prune, the channel
+ *              bounds that settle most of its tests, and the batched
+ *              kernels that test many leaves against one average
+ *              CPSC 221 PA3
+ */
+
+#ifndef _DISTANCE_H_
+#define _DISTANCE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * A pixel as a distance policy compares it: four doubles the policy fills
+ * in once per pixel, so the per-leaf test does no division or conversion.
+ */
+struct DistanceColor {
+    double r;
+    double g;
+    double b;
+    double a;
+};
+
+/**
+ * The larger of (x - low)^2 and (x - high)^2: the most (x - v)^2 can be
+ * for any v between low and high.
+ */
+inline double FarthestSquare(double x, double low, double high) {
+    return max((x - low) * (x - low), (x - high) * (x - high));
+}
+
+/**
+ * The metric of RGBAPixel::distanceTo, and of the default Prune: for each
+ * channel, the larger of the squared differences of the premultiplied
+ * colour against black and against white backgrounds, summed. Returns
+ * exactly what leaf.distanceTo(avg) does. Ranges over [0, 3].
+ */
+struct MaxAlphaDistance {
+    static inline DistanceColor Prepare(const RGBAPixel& pixel) {
+        DistanceColor c = { (pixel.r / 255.0) * pixel.a, (pixel.g / 255.0) * pixel.a,
+                            (pixel.b / 255.0) * pixel.a, pixel.a };
+        return c;
+    }
+
+    static inline double Distance(const DistanceColor& leaf, const DistanceColor& avg) {
+        double dr = avg.r - leaf.r;
+        double dg = avg.g - leaf.g;
+        double db = avg.b - leaf.b;
+        double da = avg.a - leaf.a;
+        return max(dr * dr, (dr - da) * (dr - da)) + max(dg * dg, (dg - da) * (dg - da)) +
+               max(db * db, (db - da) * (db - da));
+    }
+
+    // bounds Distance from avg over every colour whose channels lie between
+    // low and high: dr - da is (avg.r - avg.a) - (leaf.r - leaf.a), and
+    // leaf.r - leaf.a lies between low.r - high.a and high.r - low.a
+    static inline double MaxDistance(const DistanceColor& low, const DistanceColor& high, const DistanceColor& avg) {
+        return max(FarthestSquare(avg.r, low.r, high.r), FarthestSquare(avg.r - avg.a, low.r - high.a, high.r - low.a)) +
+               max(FarthestSquare(avg.g, low.g, high.g), FarthestSquare(avg.g - avg.a, low.g - high.a, high.g - low.a)) +
+               max(FarthestSquare(avg.b, low.b, high.b), FarthestSquare(avg.b - avg.a, low.b - high.a, high.b - low.a));
+    }
+};
+
+/**
+ * Squared Euclidean distance between the straight (not premultiplied)
+ * colours, with channels scaled to [0, 1]. Alpha is ignored. Ranges over [0, 3].
+ */
+struct RGBDistance {
+    static inline DistanceColor Prepare(const RGBAPixel& pixel) {
+        DistanceColor c = { pixel.r / 255.0, pixel.g / 255.0, pixel.b / 255.0, pixel.a };
+        return c;
+    }
+
+    static inline double Distance(const DistanceColor& leaf, const DistanceColor& avg) {
+        double dr = avg.r - leaf.r;
+        double dg = avg.g - leaf.g;
+        double db = avg.b - leaf.b;
+        return dr * dr + dg * dg + db * db;
+    }
+
+    // the largest Distance from avg to a colour whose channels lie between low and high
+    static inline double MaxDistance(const DistanceColor& low, const DistanceColor& high, const DistanceColor& avg) {
+        return FarthestSquare(avg.r, low.r, high.r) + FarthestSquare(avg.g, low.g, high.g) +
+               FarthestSquare(avg.b, low.b, high.b);
+    }
+};
+
+/**
+ * Squared Euclidean distance between the premultiplied colours, each
+ * channel weighted by its Rec. 601 luma coefficient (0.299, 0.587, 0.114),
+ * so differences in green count most and in blue least. The weights are
+ * folded into Prepare as their square roots. Ranges over [0, 1].
+ */
+struct LumaDistance {
+    static inline DistanceColor Prepare(const RGBAPixel& pixel) {
+        const double wr = 0.5468089245796927;  // sqrt(0.299)
+        const double wg = 0.7661592523751182;  // sqrt(0.587)
+        const double wb = 0.3376388603226826;  // sqrt(0.114)
+        double k = pixel.a / 255.0;
+        DistanceColor c = { wr * k * pixel.r, wg * k * pixel.g, wb * k * pixel.b, pixel.a };
+        return c;
+    }
+
+    static inline double Distance(const DistanceColor& leaf, const DistanceColor& avg) {
+        double dr = avg.r - leaf.r;
+        double dg = avg.g - leaf.g;
+        double db = avg.b - leaf.b;
+        return dr * dr + dg * dg + db * db;
+    }
+
+    // the largest Distance from avg to a colour whose channels lie between low and high
+    static inline double MaxDistance(const DistanceColor& low, const DistanceColor& high, const DistanceColor& avg) {
+        return FarthestSquare(avg.r, low.r, high.r) + FarthestSquare(avg.g, low.g, high.g) +
+               FarthestSquare(avg.b, low.b, high.b);
+    }
+};
+
+// leaves tested per block by ColorsWithinTolerance
+const size_t DISTANCE_BLOCK = 4;
+
+/**
+ * Range of each channel of some prepared colours, with a colour holding
+ * each extreme. Bounds are merged, so those of a quadtree node come from
+ * its children's.
+ */
+struct ColorBounds {
+    double low[4];
+    double high[4];
+    DistanceColor lowColor[4];
+    DistanceColor highColor[4];
+
+    void Reset(const DistanceColor& color) {
+        double channel[4] = { color.r, color.g, color.b, color.a };
+        for (int c = 0; c < 4; c++) {
+            low[c] = high[c] = channel[c];
+            lowColor[c] = highColor[c] = color;
+        }
+    }
+
+    void Add(const DistanceColor& color) {
+        double channel[4] = { color.r, color.g, color.b, color.a };
+        for (int c = 0; c < 4; c++) {
+            if (channel[c] < low[c]) {
+                low[c] = channel[c];
+                lowColor[c] = color;
+            }
+            if (channel[c] > high[c]) {
+                high[c] = channel[c];
+                highColor[c] = color;
+            }
+        }
+    }
+
+    void Merge(const ColorBounds& other) {
+        for (int c = 0; c < 4; c++) {
+            if (other.low[c] < low[c]) {
+                low[c] = other.low[c];
+                lowColor[c] = other.lowColor[c];
+            }
+            if (other.high[c] > high[c]) {
+                high[c] = other.high[c];
+                highColor[c] = other.highColor[c];
+            }
+        }
+    }
+};
+
+/**
+ * If bounds alone settle whether every colour they cover is within
+ * tolerance of avg under Distance, stores the answer in within and
+ * returns true. A uniform range is settled by any one colour; otherwise
+ * Distance::MaxDistance over the range may show that every colour
+ * passes, and the colours holding the extremes are tried for one that
+ * fails. If none of these settles it, the colours must be scanned.
+ */
+template <class Distance>
+bool BoundsDecide(const ColorBounds& bounds, const DistanceColor& avg, double tolerance, bool& within) {
+    bool uniform = true;
+    for (int c = 0; c < 4; c++) {
+        uniform = uniform && bounds.low[c] == bounds.high[c];
+    }
+
+    // every colour equals the witnesses
+    if (uniform) {
+        within = Distance::Distance(bounds.lowColor[0], avg) <= tolerance;
+        return true;
+    }
+
+    // margin for rounding: the bound is not computed in the order Distance uses
+    DistanceColor low = { bounds.low[0], bounds.low[1], bounds.low[2], bounds.low[3] };
+    DistanceColor high = { bounds.high[0], bounds.high[1], bounds.high[2], bounds.high[3] };
+    if (Distance::MaxDistance(low, high, avg) + 1e-9 <= tolerance) {
+        within = true;
+        return true;
+    }
+
+    for (int c = 0; c < 4; c++) {
+        if (Distance::Distance(bounds.lowColor[c], avg) > tolerance ||
+            Distance::Distance(bounds.highColor[c], avg) > tolerance) {
+            within = false;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Fills out[i] with Distance::Prepare(pixels[i]) for each of the count pixels.
+ */
+template <class Distance>
+void PrepareColors(const RGBAPixel* pixels, size_t count, DistanceColor* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = Distance::Prepare(pixels[i]);
+    }
+}
+
+/**
+ * Returns whether every one of the count colours is within tolerance of
+ * avg under Distance. The colours are taken DISTANCE_BLOCK at a time, and
+ * only the largest distance of a block is compared, so there is one
+ * branch per block rather than per leaf; the scan stops at the first
+ * block with a leaf out of tolerance. It is plain scalar code, which an
+ * optimizing compiler may or may not vectorize.
+ */
+template <class Distance>
+bool ColorsWithinTolerance(const DistanceColor* colors, size_t count, const DistanceColor& avg,
+                           double tolerance) {
+    size_t i = 0;
+    for (; i + DISTANCE_BLOCK <= count; i += DISTANCE_BLOCK) {
+        double d[DISTANCE_BLOCK];
+        for (size_t j = 0; j < DISTANCE_BLOCK; j++) {
+            d[j] = Distance::Distance(colors[i + j], avg);
+        }
+        double worst = d[0];
+        for (size_t j = 1; j < DISTANCE_BLOCK; j++) {
+            worst = max(worst, d[j]);
+        }
+        if (worst > tolerance) {
+            return false;
+        }
+    }
+    for (; i < count; i++) {
+        if (Distance::Distance(colors[i], avg) > tolerance) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
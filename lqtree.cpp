@@ -0,0 +1,374 @@
+/**
+ * @file lqtree.cpp
+ * @description implementation of LinearQTree, a pointer-free storage engine
+ *              for the same image decomposition as QTree
+ *              CPSC 221 PA3
+ */
+
+#include "lqtree.h"
+
+#include <cmath>
+#include <utility>
+
+/**
+ * Builds the tree in a single depth-first pass that appends each node
+ * before its children, so the array ends up in Morton order.
+ */
+LinearQTree::LinearQTree(const PNG& imIn) {
+    width = imIn.width();
+    height = imIn.height();
+    buildWidth = width;
+    buildHeight = height;
+
+    xx = 1; xy = 0; tx = 0;
+    yx = 0; yy = 1; ty = 0;
+
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    // a full tree has fewer than 2 * (number of pixels) nodes
+    nodes.reserve(2 * static_cast<size_t>(width) * height);
+
+    Rect r;
+    r.ulx = 0;
+    r.uly = 0;
+    r.lrx = width - 1;
+    r.lry = height - 1;
+    BuildNode(imIn.getPixel(0, 0), r);
+}
+
+/**
+ * Walks the array front to back, drawing each leaf as a run of row spans.
+ * The rectangle of each node comes from a stack holding, for every
+ * interior node still open, its children's rectangles and the end of its
+ * run, so nothing recurses.
+ */
+PNG LinearQTree::Render(unsigned int scale) const {
+    if (nodes.empty()) {
+        return PNG();  // empty image
+    }
+
+    PNG img(width * scale, height * scale);
+    RGBAPixel* canvas = img.getPixel(0, 0);
+    unsigned int canvasWidth = img.width();
+
+    Rect r;
+    r.ulx = 0;
+    r.uly = 0;
+    r.lrx = buildWidth - 1;
+    r.lry = buildHeight - 1;
+
+    vector<OpenNode> open;
+    for (unsigned int i = 0; i < nodes.size(); i++) {
+        while (!open.empty() && open.back().end == i) {
+            open.pop_back();
+        }
+        if (!open.empty()) {
+            r = open.back().children[open.back().next++];
+        }
+
+        if (nodes[i].size > 1) {
+            OpenNode nd;
+            SplitRect(r, nd.children);
+            nd.next = 0;
+            nd.end = i + nodes[i].size;
+            open.push_back(nd);
+            continue;
+        }
+
+        Rect m = MapRect(r);
+        RGBAPixel colour = Unpack(nodes[i].rgba);
+
+        unsigned int startX = m.ulx * scale;
+        unsigned int endX = (m.lrx + 1) * scale;
+        unsigned int endY = (m.lry + 1) * scale;
+
+        for (unsigned int y = m.uly * scale; y < endY; y++) {
+            RGBAPixel* row = canvas + static_cast<size_t>(y) * canvasWidth;
+            for (unsigned int x = startX; x < endX; x++) {
+                row[x] = colour;
+            }
+        }
+    }
+
+    return img;
+}
+
+/**
+ * One pass over the array from back to front, in which each node comes
+ * after its whole subtree, gathers the channel ranges of every node's
+ * leaves from its children's. A second pass, front to back, decides only
+ * the nodes it reaches: the ranges settle most of them in O(1), and only a
+ * node they cannot settle has its run of leaves scanned, stopping at the
+ * first leaf out of tolerance. The scans are what keep this from being
+ * linear in the worst case.
+ *
+ * A collapsed node's subtree is the contiguous run that follows it, so
+ * skipping it is a single jump. Surviving nodes are compacted in place;
+ * each kept interior node remembers where its original run ended, so its
+ * new size is known once the walk passes that point.
+ */
+void LinearQTree::Prune(double tolerance) {
+    if (nodes.empty()) {
+        return;
+    }
+
+    vector<LeafBounds> bounds(nodes.size());
+    for (unsigned int i = nodes.size(); i-- > 0;) {
+        if (nodes[i].size == 1) {
+            bounds[i] = LeafBounds(nodes[i].rgba);
+            continue;
+        }
+        bounds[i] = bounds[i + 1];
+        unsigned int end = i + nodes[i].size;
+        for (unsigned int child = i + 1 + nodes[i + 1].size; child < end; child += nodes[child].size) {
+            bounds[i].Merge(bounds[child]);
+        }
+    }
+
+    vector<pair<unsigned int, unsigned int> > open; // (new index, original end) of kept interior nodes
+    unsigned int count = 0;
+    unsigned int i = 0;
+    while (i < nodes.size()) {
+        while (!open.empty() && open.back().second == i) {
+            nodes[open.back().first].size = count - open.back().first;
+            open.pop_back();
+        }
+
+        LNode nd = nodes[i];
+        if (nd.size == 1) {
+            nodes[count++] = nd;
+            i++;
+        } else if (WithinTolerance(i, bounds[i], tolerance)) {
+            i += nd.size;
+            nd.size = 1;
+            nodes[count++] = nd;
+        } else {
+            open.push_back(make_pair(count, i + nd.size));
+            nodes[count++] = nd;
+            i++;
+        }
+    }
+    while (!open.empty()) {
+        nodes[open.back().first].size = count - open.back().first;
+        open.pop_back();
+    }
+
+    // only give memory back when most of the tree is gone; reallocating
+    // and copying a large array costs more than the prune itself
+    nodes.resize(count);
+    if (count < nodes.capacity() / 4) {
+        nodes.shrink_to_fit();
+    }
+}
+
+/**
+ * Composes a mirror image, x -> (width - 1) - x, onto the orientation.
+ */
+void LinearQTree::FlipHorizontal() {
+    xx = -xx;
+    xy = -xy;
+    tx = static_cast<long long>(width) - 1 - tx;
+}
+
+/**
+ * Composes (x, y) -> (y, (width - 1) - x) onto the orientation.
+ */
+void LinearQTree::RotateCCW() {
+    int oldXX = xx, oldXY = xy;
+    long long oldTX = tx;
+
+    xx = yx;
+    xy = yy;
+    tx = ty;
+
+    yx = -oldXX;
+    yy = -oldXY;
+    ty = static_cast<long long>(width) - 1 - oldTX;
+
+    swap(width, height);
+}
+
+unsigned int LinearQTree::CountNodes() const {
+    return nodes.size();
+}
+
+unsigned int LinearQTree::CountLeaves() const {
+    unsigned int leaves = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].size == 1) {
+            leaves++;
+        }
+    }
+    return leaves;
+}
+
+unsigned int LinearQTree::Pack(const RGBAPixel& pixel) {
+    unsigned int alpha = static_cast<unsigned int>(lround(pixel.a * 255));
+    return pixel.r | (pixel.g << 8) | (pixel.b << 16) | (alpha << 24);
+}
+
+RGBAPixel LinearQTree::Unpack(unsigned int rgba) {
+    return RGBAPixel(rgba & 0xff, (rgba >> 8) & 0xff, (rgba >> 16) & 0xff, (rgba >> 24) / 255.);
+}
+
+unsigned int LinearQTree::SplitRect(const Rect& r, Rect children[4]) {
+    unsigned int w = r.lrx - r.ulx + 1;
+    unsigned int h = r.lry - r.uly + 1;
+
+    unsigned int midX = r.ulx + w / 2;
+    unsigned int midY = r.uly + h / 2;
+
+    if (w % 2 == 0) midX--;
+    if (h % 2 == 0) midY--;
+
+    unsigned int n = 0;
+
+    // NW
+    children[n].ulx = r.ulx; children[n].uly = r.uly;
+    children[n].lrx = midX; children[n].lry = midY;
+    n++;
+
+    // NE
+    if (w > 1) {
+        children[n].ulx = midX + 1; children[n].uly = r.uly;
+        children[n].lrx = r.lrx; children[n].lry = midY;
+        n++;
+    }
+
+    // SW
+    if (h > 1) {
+        children[n].ulx = r.ulx; children[n].uly = midY + 1;
+        children[n].lrx = midX; children[n].lry = r.lry;
+        n++;
+    }
+
+    // SE
+    if (w > 1 && h > 1) {
+        children[n].ulx = midX + 1; children[n].uly = midY + 1;
+        children[n].lrx = r.lrx; children[n].lry = r.lry;
+        n++;
+    }
+
+    return n;
+}
+
+LinearQTree::Rect LinearQTree::MapRect(const Rect& r) const {
+    long long x1 = xx * static_cast<long long>(r.ulx) + xy * static_cast<long long>(r.uly) + tx;
+    long long y1 = yx * static_cast<long long>(r.ulx) + yy * static_cast<long long>(r.uly) + ty;
+    long long x2 = xx * static_cast<long long>(r.lrx) + xy * static_cast<long long>(r.lry) + tx;
+    long long y2 = yx * static_cast<long long>(r.lrx) + yy * static_cast<long long>(r.lry) + ty;
+
+    Rect mapped;
+    mapped.ulx = static_cast<unsigned int>(min(x1, x2));
+    mapped.uly = static_cast<unsigned int>(min(y1, y2));
+    mapped.lrx = static_cast<unsigned int>(max(x1, x2));
+    mapped.lry = static_cast<unsigned int>(max(y1, y2));
+    return mapped;
+}
+
+/**
+ * Appends the node for r, then its subtree, and computes the node's average
+ * from its children in the same way as QTree::calculateAverageColour.
+ */
+unsigned int LinearQTree::BuildNode(const RGBAPixel* pixels, const Rect& r) {
+    unsigned int index = nodes.size();
+
+    LNode nd;
+    nd.size = 1;
+
+    if (r.ulx == r.lrx && r.uly == r.lry) {
+        nd.rgba = Pack(pixels[r.ulx + static_cast<size_t>(r.uly) * buildWidth]);
+        nodes.push_back(nd);
+        return index;
+    }
+    nd.rgba = 0;
+    nodes.push_back(nd);
+
+    Rect children[4];
+    unsigned int numChildren = SplitRect(r, children);
+
+    unsigned long long totalR = 0, totalG = 0, totalB = 0;
+    unsigned int totalArea = 0;
+
+    for (unsigned int c = 0; c < numChildren; c++) {
+        unsigned int rgba = nodes[BuildNode(pixels, children[c])].rgba;
+        unsigned int childArea = (children[c].lrx - children[c].ulx + 1) * (children[c].lry - children[c].uly + 1);
+        totalR += static_cast<unsigned long long>(rgba & 0xff) * childArea;
+        totalG += static_cast<unsigned long long>((rgba >> 8) & 0xff) * childArea;
+        totalB += static_cast<unsigned long long>((rgba >> 16) & 0xff) * childArea;
+        totalArea += childArea;
+    }
+
+    LNode& built = nodes[index];
+    built.rgba = Pack(RGBAPixel(static_cast<unsigned char>(totalR / totalArea),
+                                static_cast<unsigned char>(totalG / totalArea),
+                                static_cast<unsigned char>(totalB / totalArea)));
+    built.size = nodes.size() - index;
+    return index;
+}
+
+LinearQTree::LeafBounds::LeafBounds(unsigned int rgba) {
+    for (int c = 0; c < 4; c++) {
+        low[c] = high[c] = (rgba >> (8 * c)) & 0xff;
+    }
+}
+
+void LinearQTree::LeafBounds::Merge(const LeafBounds& other) {
+    for (int c = 0; c < 4; c++) {
+        low[c] = min(low[c], other.low[c]);
+        high[c] = max(high[c], other.high[c]);
+    }
+}
+
+/**
+ * The bound of QTree's RegionBounds: over the box of channel ranges, each
+ * of distanceTo's squares is largest at one end of its interval.
+ */
+double LinearQTree::LeafBounds::MaxDistanceTo(const RGBAPixel& avg) const {
+    const double scale = 1 / 255.0;
+    double lowA = low[3] * scale, highA = high[3] * scale;
+    double avgChannel[3] = { avg.r * scale * avg.a, avg.g * scale * avg.a, avg.b * scale * avg.a };
+    double total = 0;
+    for (int c = 0; c < 3; c++) {
+        double avgP = avgChannel[c];
+        double d1 = avgP - high[c] * scale * highA;
+        double d2 = avgP - low[c] * scale * lowA;
+        double e1 = avgP - avg.a + lowA * (1 - high[c] * scale);
+        double e2 = avgP - avg.a + highA * (1 - low[c] * scale);
+        total += max(max(d1 * d1, d2 * d2), max(e1 * e1, e2 * e2));
+    }
+    return total;
+}
+
+/**
+ * Decides whether every leaf below nodes[index] is within tolerance of its
+ * average: from the bounds if they show every leaf passes, and otherwise
+ * by scanning the node's run.
+ */
+bool LinearQTree::WithinTolerance(unsigned int index, const LeafBounds& bounds, double tolerance) const {
+    RGBAPixel avg = Unpack(nodes[index].rgba);
+
+    // margin for rounding: the bound is not computed in the order distanceTo uses
+    if (bounds.MaxDistanceTo(avg) + 1e-9 <= tolerance) {
+        return true;
+    }
+    return allLeavesWithinTolerance(index, avg, tolerance);
+}
+
+/**
+ * The leaves of nodes[index] are exactly the leaves in its contiguous run.
+ */
+bool LinearQTree::allLeavesWithinTolerance(unsigned int index, const RGBAPixel& avg, double tolerance) const {
+    unsigned int end = index + nodes[index].size;
+    for (unsigned int i = index; i < end; i++) {
+        if (nodes[i].size == 1) {
+            RGBAPixel leaf = Unpack(nodes[i].rgba);
+            if (leaf.distanceTo(avg) > tolerance) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
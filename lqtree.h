@@ -0,0 +1,180 @@
+/**
+ * @file lqtree.h
+ * @description declaration of LinearQTree, a pointer-free storage engine
+ *              for the same image decomposition as QTree
+ *              CPSC 221 PA3
+ */
+
+#ifndef _LQTREE_H_
+#define _LQTREE_H_
+
+#include <vector>
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * LinearQTree: decomposes an image into exactly the same rectangles and
+ * average colours as QTree, but keeps every node in one contiguous array
+ * instead of one heap allocation per node.
+ *
+ * Nodes are stored in Morton (depth-first, NW-NE-SW-SE) order: every node
+ * is immediately followed by its whole subtree, so a subtree is always a
+ * contiguous run of the array. Each node records the length of its run as
+ * a 32-bit count, which links it to its next sibling; its first child is
+ * the element right after it. Traversals therefore walk memory front to
+ * back instead of chasing pointers.
+ *
+ * A node is 8 bytes: the run length and its average colour packed as
+ * RGBA8. Rectangles are not stored; they follow from the image size and
+ * the splitting rule, and are recomputed on the way down a traversal.
+ * Flips and rotations are recorded as one transform for the whole tree
+ * and applied to each rectangle as it is drawn, so they take constant time.
+ *
+ * Alpha is kept to 8 bits. Images read from PNG files have 8-bit alpha,
+ * so trees built from them render exactly like the corresponding QTree.
+ *
+ * Render, Prune, FlipHorizontal, RotateCCW, CountNodes and CountLeaves
+ * produce the same results as the corresponding QTree functions.
+ */
+class LinearQTree {
+public:
+
+    /**
+     * Builds the tree out of the given PNG, using the same splitting rule
+     * and constant-time average colour computation as QTree(const PNG&).
+     */
+    LinearQTree(const PNG& imIn);
+
+    /**
+     * Draws every leaf's rectangle onto a PNG canvas using its average colour.
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @pre scale > 0
+     */
+    PNG Render(unsigned int scale) const;
+
+    /**
+     * Trims subtrees as high as possible in the tree, using the same
+     * criterion as QTree::Prune.
+     * @param tolerance maximum RGBA distance to qualify for pruning
+     * @pre this tree has not previously been pruned.
+     */
+    void Prune(double tolerance);
+
+    /**
+     * Mirrors the rendered image across a vertical axis.
+     */
+    void FlipHorizontal();
+
+    /**
+     * Rotates the rendered image by 90 degrees counter-clockwise.
+     */
+    void RotateCCW();
+
+    /**
+     * Counts the number of nodes in the tree
+     */
+    unsigned int CountNodes() const;
+
+    /**
+     * Counts the number of leaves in the tree
+     */
+    unsigned int CountLeaves() const;
+
+private:
+    /**
+     * One element of the node array.
+     */
+    struct LNode {
+        unsigned int size; // number of nodes in this subtree, 1 for a leaf
+        unsigned int rgba; // average color, packed by Pack
+    };
+
+    /**
+     * A rectangle in image coordinates, corners inclusive.
+     */
+    struct Rect {
+        unsigned int ulx, uly; // upper-left corner
+        unsigned int lrx, lry; // lower-right corner
+    };
+
+    /**
+     * An interior node a traversal is inside of: its children's
+     * rectangles, the next of them to visit, and the end of its run.
+     */
+    struct OpenNode {
+        Rect children[4];
+        unsigned int next;
+        unsigned int end;
+    };
+
+    /**
+     * Range of each RGBA8 channel over the leaves of a subtree.
+     */
+    struct LeafBounds {
+        unsigned char low[4], high[4];
+
+        LeafBounds() {}
+        LeafBounds(unsigned int rgba);
+        void Merge(const LeafBounds& other);
+
+        // upper bound on leaf.distanceTo(avg) over every leaf in the bounds
+        double MaxDistanceTo(const RGBAPixel& avg) const;
+    };
+
+    vector<LNode> nodes; // all nodes, in Morton order
+
+    unsigned int height; // height of PNG represented by the tree
+    unsigned int width; // width of PNG represented by the tree
+
+    unsigned int buildHeight; // height of the PNG the tree was built from
+    unsigned int buildWidth; // width of the PNG the tree was built from
+
+    // current orientation: build-time pixel (x, y) is rendered at
+    // (xx * x + xy * y + tx, yx * x + yy * y + ty)
+    int xx, xy, yx, yy;
+    long long tx, ty;
+
+    /**
+     * Packs a pixel into RGBA8, rounding alpha to the nearest 1/255.
+     */
+    static unsigned int Pack(const RGBAPixel& pixel);
+
+    /**
+     * Unpacks an RGBA8 colour made by Pack.
+     */
+    static RGBAPixel Unpack(unsigned int rgba);
+
+    /**
+     * Splits r as QTree's constructor does.
+     * @param children receives the children that exist, in NW, NE, SW, SE order
+     * @return the number of children
+     */
+    static unsigned int SplitRect(const Rect& r, Rect children[4]);
+
+    /**
+     * Maps a build-time rectangle into the current orientation.
+     */
+    Rect MapRect(const Rect& r) const;
+
+    /**
+     * Appends the subtree for the given rectangle to nodes.
+     * @return the index of the subtree's root
+     */
+    unsigned int BuildNode(const RGBAPixel* pixels, const Rect& r);
+
+    /**
+     * Checks whether every leaf below nodes[index], whose leaves have the
+     * given bounds, is within tolerance of the node's average.
+     */
+    bool WithinTolerance(unsigned int index, const LeafBounds& bounds, double tolerance) const;
+
+    /**
+     * Checks whether every leaf below nodes[index] is within tolerance of avg.
+     */
+    bool allLeavesWithinTolerance(unsigned int index, const RGBAPixel& avg, double tolerance) const;
+};
+
+#endif
@@ -8,10 +8,20 @@
  *              THIS FILE WILL NOT BE SUBMITTED
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "qtree.h"
+#include "lqtree.h"
+#include "workpool.h"
 
 using namespace std;
 
@@ -22,6 +32,33 @@ void TestBuildRender(unsigned int scale);
 void TestFlipHorizontal();
 void TestRotateCCW();
 void TestPrune(double tol);
+void TestPruneReference();
+void TestLinearQTree(double tol);
+void TestLinearQTreeSpeed(unsigned int size);
+void TestParallelBuild(unsigned int threads);
+void TestWorkPool();
+void TestPyramidBuild();
+void TestBufferBuild();
+void TestMergedBuild(double tol);
+void TestLazyBuild(unsigned int depth);
+void TestBuildStats();
+void TestExactAverages();
+void TestRenderScales();
+void TestRenderInto();
+void TestRenderRegion();
+void TestRenderLOD();
+void TestRenderIncremental();
+void TestRenderSize();
+void TestRenderToFile();
+void TestPruneTo();
+void TestPruneBudgets();
+void TestPruneDistance();
+void TestPrunedView();
+void TestExportTiles(unsigned int tileSize);
+
+PNG WithAlphaRamp(const PNG& image);
+PNG Crop(const PNG& image, unsigned int left, unsigned int top, unsigned int width, unsigned int height);
+void Paste(PNG& target, const PNG& source, unsigned int left, unsigned int top);
 
 /***********************************/
 /*** MAIN FUNCTION PROGRAM ENTRY ***/
@@ -35,6 +72,29 @@ int main(int argc, char* argv[]) {
 	TestRotateCCW();
 	//TestPrune(0.01);
 	//TestPrune(0.05);
+	//TestPruneReference();
+	//TestLinearQTree(0.05);
+	//TestLinearQTreeSpeed(4096);
+	//TestParallelBuild(4);
+	//TestWorkPool();
+	//TestPyramidBuild();
+	//TestBufferBuild();
+	//TestMergedBuild(0.05);
+	//TestLazyBuild(4);
+	//TestBuildStats();
+	//TestExactAverages();
+	//TestRenderScales();
+	//TestRenderInto();
+	//TestRenderRegion();
+	//TestRenderLOD();
+	//TestRenderIncremental();
+	//TestRenderSize();
+	//TestRenderToFile();
+	//TestPruneTo();
+	//TestPruneBudgets();
+	//TestPruneDistance();
+	//TestPrunedView();
+	//TestExportTiles(16);
 
 	PNG image(2, 2); 
 
@@ -224,4 +284,1036 @@ void TestPrune(double tol) {
 	cout << "done." << endl;
 
 	cout << "Exiting TestPrune.\n" << endl;
-}
\ No newline at end of file
+}
+
+void TestPruneReference() {
+	cout << "Entered TestPruneReference" << endl;
+
+	// read input PNGs
+	PNG photo;
+	photo.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	PNG portrait;
+	portrait.readFromFile("images-original/malachi-60x87.png");
+	PNG images[] = {photo, WithAlphaRamp(photo), portrait};
+	string names[] = {"kkkk_nnkm", "kkkk_nnkm with alpha", "malachi"};
+
+	// LinearQTree decides each node top-down from a scan of all its leaves
+	double tolerances[] = {0.0, 0.001, 0.02, 0.1, 0.5};
+	for (int i = 0; i < 3; i++) {
+		bool same = true;
+		for (double tol : tolerances) {
+			QTree t(images[i]);
+			t.Prune(tol);
+			LinearQTree lt(images[i]);
+			lt.Prune(tol);
+			BuildOptions options;
+			options.lazyDepth = 2;
+			QTree lazy(images[i], options);
+			lazy.Prune(tol);
+			PNG expected = lt.Render(1);
+			same = same && t.CountLeaves() == lt.CountLeaves() && t.Render(1) == expected && lazy.Render(1) == expected;
+		}
+		cout << names[i] << ": Prune " << (same ? "matches" : "differs from") << " LinearQTree::Prune at every tolerance." << endl;
+	}
+
+	cout << "Exiting TestPruneReference.\n" << endl;
+}
+
+void TestLinearQTree(double tol) {
+	cout << "Entered TestLinearQTree, tolerance: " << tol << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree and LinearQTree from image... ";
+	QTree t(input);
+	LinearQTree lt(input);
+	cout << "done." << endl;
+
+	cout << "LinearQTree contains " << lt.CountNodes() << " nodes and " << lt.CountLeaves() << " leaves." << endl;
+	cout << "Renders " << (t.Render(1) == lt.Render(1) ? "match" : "differ") << " after construction." << endl;
+
+	t.Prune(tol);
+	lt.Prune(tol);
+	cout << "Pruned LinearQTree contains " << lt.CountNodes() << " nodes and " << lt.CountLeaves() << " leaves." << endl;
+	cout << "Renders " << (t.Render(1) == lt.Render(1) ? "match" : "differ") << " after Prune." << endl;
+
+	t.FlipHorizontal();
+	lt.FlipHorizontal();
+	t.RotateCCW();
+	lt.RotateCCW();
+	cout << "Renders " << (t.Render(2) == lt.Render(2) ? "match" : "differ") << " after FlipHorizontal and RotateCCW." << endl;
+
+	cout << "Exiting TestLinearQTree.\n" << endl;
+}
+
+// milliseconds taken by f()
+template <class F>
+double TimeMs(F f) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	f();
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+void TestLinearQTreeSpeed(unsigned int size) {
+	cout << "Entered TestLinearQTreeSpeed, size: " << size << endl;
+
+	// tile the test photo out to size x size
+	PNG tile;
+	tile.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	PNG input(size, size);
+	for (unsigned int y = 0; y < size; y++) {
+		for (unsigned int x = 0; x < size; x++) {
+			*input.getPixel(x, y) = *tile.getPixel(x % tile.width(), y % tile.height());
+		}
+	}
+
+	cout << "Constructing QTree and LinearQTree from image... ";
+	QTree t(input);
+	LinearQTree lt(input);
+	cout << "done." << endl;
+
+	PNG treeOut, linearOut;
+	double treeMs = TimeMs([&]() { treeOut = t.Render(1); });
+	double linearMs = TimeMs([&]() { linearOut = lt.Render(1); });
+	cout << "Render: QTree " << treeMs << " ms, LinearQTree " << linearMs << " ms, " << treeMs / linearMs << "x, renders " << (treeOut == linearOut ? "match" : "differ") << "." << endl;
+
+	treeMs = TimeMs([&]() { t.Prune(0.05); });
+	linearMs = TimeMs([&]() { lt.Prune(0.05); });
+	cout << "Prune: QTree " << treeMs << " ms, LinearQTree " << linearMs << " ms, " << treeMs / linearMs << "x, counts " << (t.CountLeaves() == lt.CountLeaves() ? "match" : "differ") << "." << endl;
+
+	cout << "Exiting TestLinearQTreeSpeed.\n" << endl;
+}
+
+void TestParallelBuild(unsigned int threads) {
+	cout << "Entered TestParallelBuild, threads: " << threads << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image sequentially and in parallel... ";
+	QTree t(input);
+	BuildOptions options;
+	options.threads = threads;
+	options.cutoff = 1024;
+	QTree pt(input, options);
+	cout << "done." << endl;
+
+	cout << "Parallel tree contains " << pt.CountNodes() << " nodes and " << pt.CountLeaves() << " leaves." << endl;
+	cout << "Renders " << (t.Render(1) == pt.Render(1) ? "match" : "differ") << " after parallel build." << endl;
+
+	cout << "Exiting TestParallelBuild.\n" << endl;
+}
+
+void TestWorkPool() {
+	cout << "Entered TestWorkPool" << endl;
+
+	WorkPool pool(4);
+	atomic<unsigned int> ran(0);
+	WorkPool::TaskGroup group;
+	for (unsigned int i = 0; i < 64; i++) {
+		pool.Spawn(group, [&ran, i]() {
+			if (i == 17) {
+				throw runtime_error("task 17 failed");
+			}
+			ran++;
+		});
+	}
+	try {
+		pool.Wait(group);
+		cout << "Wait returned without the task's exception." << endl;
+	}
+	catch (const runtime_error& e) {
+		cout << "Wait rethrew \"" << e.what() << "\" after " << ran.load() << " of 63 other tasks ran." << endl;
+	}
+
+	WorkPool::TaskGroup next;
+	for (unsigned int i = 0; i < 64; i++) {
+		pool.Spawn(next, [&ran]() { ran++; });
+	}
+	pool.Wait(next);
+	cout << "Pool " << (ran.load() == 127 ? "still runs tasks" : "lost tasks") << " after a task threw." << endl;
+
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	QTree t(input);
+	PNG once = t.Render(2, 4);
+	bool same = true;
+	for (int i = 0; i < 8; i++) {
+		same = same && t.Render(2, 4) == once;
+	}
+	cout << "Repeated threaded renders of one tree " << (same ? "match" : "differ") << "." << endl;
+
+	cout << "Exiting TestWorkPool.\n" << endl;
+}
+
+void TestPyramidBuild() {
+	cout << "Entered TestPyramidBuild" << endl;
+
+	string files[] = {"images-original/malachi-60x87.png", "images-original/kkkk_nnkm-256x224.png"};
+	for (const string& file : files) {
+		// read input PNG
+		PNG input;
+		input.readFromFile(file);
+
+		QTree t(input);
+		BuildOptions options;
+		options.pyramid = true;
+		QTree pt(input, options);
+
+		// RenderLOD draws interior averages, which must match level by level too
+		bool same = pt.CountNodes() == t.CountNodes() && pt.CountLeaves() == t.CountLeaves() && pt.Render(1) == t.Render(1);
+		for (unsigned int depth = 0; depth < 8; depth++) {
+			same = same && pt.RenderLOD(depth) == t.RenderLOD(depth);
+		}
+		t.Prune(0.05);
+		pt.Prune(0.05);
+		same = same && pt.Render(1) == t.Render(1);
+		cout << file << ": pyramid build " << (same ? "matches" : "differs from") << " sequential build." << endl;
+	}
+
+	cout << "Exiting TestPyramidBuild.\n" << endl;
+}
+
+// a copy of image with alpha varying across it, in steps of 1/255 as a PNG file holds it
+PNG WithAlphaRamp(const PNG& image) {
+	PNG out = image;
+	for (unsigned int y = 0; y < out.height(); y++) {
+		for (unsigned int x = 0; x < out.width(); x++) {
+			out.getPixel(x, y)->a = ((x * 7 + y * 13) % 256) / 255.0;
+		}
+	}
+	return out;
+}
+
+// the width x height block of image with top left pixel (left, top); pixels past its edges keep PNG's default colour
+PNG Crop(const PNG& image, unsigned int left, unsigned int top, unsigned int width, unsigned int height) {
+	PNG out(width, height);
+	for (unsigned int y = 0; y < height && top + y < image.height(); y++) {
+		for (unsigned int x = 0; x < width && left + x < image.width(); x++) {
+			*out.getPixel(x, y) = *image.getPixel(left + x, top + y);
+		}
+	}
+	return out;
+}
+
+// copies source into target with its top left pixel at (left, top), clipped to target
+void Paste(PNG& target, const PNG& source, unsigned int left, unsigned int top) {
+	for (unsigned int y = 0; y < source.height() && top + y < target.height(); y++) {
+		for (unsigned int x = 0; x < source.width() && left + x < target.width(); x++) {
+			*target.getPixel(left + x, top + y) = *source.getPixel(x, y);
+		}
+	}
+}
+
+void TestBufferBuild() {
+	cout << "Entered TestBufferBuild" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+	PNG faded = WithAlphaRamp(input);
+
+	// pack into RGBA8 rows with 8 bytes of padding after each
+	size_t stride = 4 * faded.width() + 8;
+	vector<unsigned char> bytes(stride * faded.height(), 0);
+	for (unsigned int y = 0; y < faded.height(); y++) {
+		for (unsigned int x = 0; x < faded.width(); x++) {
+			RGBAPixel* pixel = faded.getPixel(x, y);
+			unsigned char* out = &bytes[y * stride + 4 * x];
+			out[0] = pixel->r;
+			out[1] = pixel->g;
+			out[2] = pixel->b;
+			out[3] = static_cast<unsigned char>(pixel->a * 255 + 0.5);
+		}
+	}
+
+	QTree t(faded);
+	QTree bt(bytes.data(), faded.width(), faded.height(), stride);
+	bool same = bt.CountNodes() == t.CountNodes() && bt.Render(1) == t.Render(1) && bt.RenderLOD(4) == t.RenderLOD(4);
+	cout << "Buffer build " << (same ? "matches" : "differs from") << " PNG build." << endl;
+
+	BuildOptions options;
+	options.lazyDepth = 3;
+	QTree lazy(bytes.data(), faded.width(), faded.height(), stride, options);
+	cout << "Lazy buffer build " << (lazy.Render(1) == t.Render(1) ? "matches" : "differs from") << " PNG build." << endl;
+
+	cout << "Exiting TestBufferBuild.\n" << endl;
+}
+
+void TestMergedBuild(double tol) {
+	cout << "Entered TestMergedBuild, tolerance: " << tol << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing and pruning QTree from image... ";
+	QTree t(input);
+	t.Prune(tol);
+	cout << "done." << endl;
+
+	cout << "Constructing QTree with merge tolerance... ";
+	BuildOptions options;
+	options.mergeTolerance = tol;
+	QTree mt(input, options);
+	cout << "done." << endl;
+
+	cout << "Merged tree contains " << mt.CountNodes() << " nodes and " << mt.CountLeaves() << " leaves." << endl;
+	cout << "Pruned tree contains " << t.CountNodes() << " nodes and " << t.CountLeaves() << " leaves." << endl;
+	cout << "Renders " << (t.Render(1) == mt.Render(1) ? "match" : "differ") << " after merged build." << endl;
+	cout << "Merged build reserved " << mt.Stats().bytes / 1024 << " KB for " << mt.Stats().nodes << " nodes; full build "
+	     << QTree(input).Stats().bytes / 1024 << " KB." << endl;
+
+	options.threads = 4;
+	options.cutoff = 1024;
+	QTree pt(input, options);
+	cout << "Renders " << (t.Render(1) == pt.Render(1) ? "match" : "differ") << " after threaded merged build." << endl;
+
+	options.threads = 1;
+	options.exactAverages = true;
+	QTree et(input, options);
+	BuildOptions exact;
+	exact.exactAverages = true;
+	QTree ept(input, exact);
+	ept.Prune(tol);
+	cout << "Renders " << (ept.Render(1) == et.Render(1) ? "match" : "differ") << " after merged build with exact averages." << endl;
+
+	cout << "Exiting TestMergedBuild.\n" << endl;
+}
+
+void TestLazyBuild(unsigned int depth) {
+	cout << "Entered TestLazyBuild, depth: " << depth << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image eagerly and lazily... ";
+	QTree t(input);
+	BuildOptions options;
+	options.lazyDepth = depth;
+	QTree lt(input, options);
+	cout << "done." << endl;
+
+	// counted and drawn to the depth built so far without building any further
+	QTree fresh(input, options);
+	unsigned long built = fresh.Stats().nodes;
+	bool counts = fresh.CountNodes() == t.CountNodes() && fresh.CountLeaves() == t.CountLeaves();
+	cout << "Counts " << (counts ? "match" : "differ") << " before the lazy tree is built, which "
+	     << (fresh.Stats().nodes == built ? "stays" : "does not stay") << " at " << built << " nodes." << endl;
+	cout << "Stub averages " << (fresh.RenderLOD(depth) == t.RenderLOD(depth) ? "match" : "differ") << " at depth " << depth << "." << endl;
+
+	PNG output = t.Render(1);
+	bool same = true;
+	for (unsigned int y = 0; y < input.height(); y += 7) {
+		for (unsigned int x = 0; x < input.width(); x += 7) {
+			same = same && lt.ColourAt(x, y) == *output.getPixel(x, y);
+		}
+	}
+	cout << "Point queries " << (same ? "match" : "differ") << " on lazy tree." << endl;
+	cout << "Renders " << (output == lt.Render(1) ? "match" : "differ") << " after lazy build." << endl;
+
+	cout << "Lazy tree contains " << lt.CountNodes() << " nodes and " << lt.CountLeaves() << " leaves." << endl;
+
+	cout << "Exiting TestLazyBuild.\n" << endl;
+}
+
+// whether two trees have the same node and leaf counts at every depth
+bool SameStats(const TreeStats& a, const TreeStats& b) {
+	return a.nodes == b.nodes && a.leaves == b.leaves && a.depths == b.depths;
+}
+
+void TestBuildStats() {
+	cout << "Entered TestBuildStats" << endl;
+
+	string files[] = {"images-original/malachi-60x87.png", "images-original/kkkk_nnkm-256x224.png"};
+	for (const string& file : files) {
+		// read input PNG
+		PNG input;
+		input.readFromFile(file);
+
+		QTree t(input);
+		TreeStats stats = t.Stats();
+		unsigned long total = 0;
+		for (unsigned long count : stats.depths) {
+			total += count;
+		}
+		bool counted = stats.leaves == input.width() * input.height() && total == stats.nodes;
+		cout << file << ": sequential build " << (counted ? "counts" : "does not count") << " a leaf per pixel across its depths." << endl;
+
+		QTree pruned(input);
+		pruned.Prune(0.05);
+
+		BuildOptions variants[6];
+		variants[0].pyramid = true;
+		variants[1].threads = 4;
+		variants[1].cutoff = 256;
+		variants[2].lazyDepth = 3;
+		variants[3].mergeTolerance = 0.05;
+		variants[4].mergeTolerance = 0.05;
+		variants[4].threads = 4;
+		variants[4].cutoff = 256;
+		variants[5].mergeTolerance = 0.05;
+		variants[5].pyramid = true;
+		string names[6] = {"pyramid", "threaded", "lazy", "merged", "threaded merged", "pyramid merged"};
+		for (int i = 0; i < 6; i++) {
+			QTree built(input, variants[i]);
+			// a lazy tree counts only what it has built until it is rendered
+			if (variants[i].lazyDepth > 0) {
+				built.Render(1);
+			}
+			bool merged = variants[i].mergeTolerance >= 0;
+			bool same = SameStats(built.Stats(), merged ? pruned.Stats() : t.Stats());
+			cout << file << ": " << names[i] << " build stats " << (same ? "match" : "differ from") << " the "
+			     << (merged ? "pruned " : "") << "sequential build." << endl;
+		}
+	}
+
+	cout << "Exiting TestBuildStats.\n" << endl;
+}
+
+// checks the average of every node of the rectangle (ul, lr) down to depth maxDepth,
+// split as QTree splits it, against sums over image, as drawn by lod at the depth of each
+bool ExactAveragesMatch(const PNG& image, const PNG* lod, unsigned int ulx, unsigned int uly, unsigned int lrx, unsigned int lry,
+                        unsigned int depth, unsigned int maxDepth) {
+	unsigned int w = lrx - ulx + 1;
+	unsigned int h = lry - uly + 1;
+	if (w == 1 && h == 1) {
+		return true;  // a leaf is its pixel
+	}
+
+	unsigned long long sums[4] = {0, 0, 0, 0};
+	for (unsigned int y = uly; y <= lry; y++) {
+		for (unsigned int x = ulx; x <= lrx; x++) {
+			RGBAPixel* pixel = image.getPixel(x, y);
+			unsigned long long alpha = static_cast<unsigned long long>(pixel->a * 255 + 0.5);
+			sums[0] += pixel->r * alpha;
+			sums[1] += pixel->g * alpha;
+			sums[2] += pixel->b * alpha;
+			sums[3] += alpha;
+		}
+	}
+	RGBAPixel expected(0, 0, 0, 0.0);
+	if (sums[3] > 0) {
+		expected = RGBAPixel((2 * sums[0] + sums[3]) / (2 * sums[3]), (2 * sums[1] + sums[3]) / (2 * sums[3]),
+		                     (2 * sums[2] + sums[3]) / (2 * sums[3]), sums[3] / (255.0 * w * h));
+	}
+	if (*lod[depth].getPixel(ulx, uly) != expected) {
+		return false;
+	}
+	if (depth == maxDepth) {
+		return true;
+	}
+
+	// the split of QTree's build
+	unsigned int midX = ulx + w / 2 - (w % 2 == 0 ? 1 : 0);
+	unsigned int midY = uly + h / 2 - (h % 2 == 0 ? 1 : 0);
+	if (w == 1) {
+		return ExactAveragesMatch(image, lod, ulx, uly, lrx, midY, depth + 1, maxDepth) &&
+		       ExactAveragesMatch(image, lod, ulx, midY + 1, lrx, lry, depth + 1, maxDepth);
+	}
+	if (h == 1) {
+		return ExactAveragesMatch(image, lod, ulx, uly, midX, lry, depth + 1, maxDepth) &&
+		       ExactAveragesMatch(image, lod, midX + 1, uly, lrx, lry, depth + 1, maxDepth);
+	}
+	return ExactAveragesMatch(image, lod, ulx, uly, midX, midY, depth + 1, maxDepth) &&
+	       ExactAveragesMatch(image, lod, midX + 1, uly, lrx, midY, depth + 1, maxDepth) &&
+	       ExactAveragesMatch(image, lod, ulx, midY + 1, midX, lry, depth + 1, maxDepth) &&
+	       ExactAveragesMatch(image, lod, midX + 1, midY + 1, lrx, lry, depth + 1, maxDepth);
+}
+
+void TestExactAverages() {
+	cout << "Entered TestExactAverages" << endl;
+
+	string files[] = {"images-original/malachi-60x87.png", "images-original/kkkk_nnkm-256x224.png"};
+	for (const string& file : files) {
+		// read input PNG
+		PNG input;
+		input.readFromFile(file);
+		PNG faded = WithAlphaRamp(input);
+
+		BuildOptions options;
+		options.exactAverages = true;
+		QTree t(faded, options);
+
+		const unsigned int maxDepth = 5;
+		PNG lod[maxDepth + 1];
+		for (unsigned int depth = 0; depth <= maxDepth; depth++) {
+			lod[depth] = t.RenderLOD(depth);
+		}
+		bool same = ExactAveragesMatch(faded, lod, 0, 0, faded.width() - 1, faded.height() - 1, 0, maxDepth);
+		cout << file << ": exact averages to depth " << maxDepth << " " << (same ? "match" : "differ from") << " sums over the pixels." << endl;
+
+		// the other builds, and a copy, keep the same sums
+		BuildOptions variants[3] = {options, options, options};
+		variants[0].pyramid = true;
+		variants[1].threads = 4;
+		variants[1].cutoff = 64;
+		variants[2].lazyDepth = 2;
+		string names[3] = {"pyramid", "threaded", "lazy"};
+		for (int i = 0; i < 3; i++) {
+			QTree built(faded, variants[i]);
+			QTree copy(built);
+			bool agrees = true;
+			for (unsigned int depth = 0; depth <= maxDepth; depth++) {
+				agrees = agrees && built.RenderLOD(depth) == lod[depth] && copy.RenderLOD(depth) == lod[depth];
+			}
+			cout << file << ": " << names[i] << " build and its copy " << (agrees ? "match" : "differ from") << " the exact averages." << endl;
+		}
+	}
+
+	cout << "Exiting TestExactAverages.\n" << endl;
+}
+
+void TestRenderScales() {
+	cout << "Entered TestRenderScales" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	vector<unsigned int> scales = {1, 2, 6};
+	cout << "Rendering tree to PNGs at x1, x2 and x6 scale in one pass... ";
+	vector<PNG> outputs = t.RenderScales(scales);
+	cout << "done." << endl;
+
+	for (size_t i = 0; i < scales.size(); i++) {
+		cout << "x" << scales[i] << " render " << (outputs[i] == t.Render(scales[i]) ? "matches" : "differs from") << " Render." << endl;
+
+		// write output PNG
+		string outfilename = "images-output/malachi-render_x" + to_string(scales[i]) + "-batch.png";
+		outputs[i].writeToFile(outfilename);
+	}
+
+	cout << "Exiting TestRenderScales.\n" << endl;
+}
+
+void TestRenderInto() {
+	cout << "Entered TestRenderInto" << endl;
+
+	// read input PNGs
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+	PNG other;
+	other.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTrees from images... ";
+	QTree t(input);
+	QTree u(other);
+	cout << "done." << endl;
+
+	// an atlas of both trees side by side at x2, on a canvas marked so stray writes show
+	PNG canvas(2 * input.width() + 2 * other.width() + 7, 2 * other.height() + 5);
+	for (unsigned int y = 0; y < canvas.height(); y++) {
+		for (unsigned int x = 0; x < canvas.width(); x++) {
+			*canvas.getPixel(x, y) = RGBAPixel(255, 0, 255, 0.5);
+		}
+	}
+	PNG expected = canvas;
+	Paste(expected, t.Render(2), 3, 5);
+	Paste(expected, u.Render(2), 2 * input.width() + 7, 0);
+
+	unsigned int threads[] = {1, 4};
+	for (unsigned int n : threads) {
+		PNG atlas = canvas;
+		t.RenderInto(atlas, 3, 5, 2, n);
+		u.RenderInto(atlas, 2 * input.width() + 7, 0, 2, n);
+		cout << "Atlas with " << n << " thread(s) " << (atlas == expected ? "matches" : "differs from") << " Render at its offsets." << endl;
+	}
+
+	// offsets that put part of the render past the right and bottom edges
+	unsigned int offsets[][2] = {{40, 30}, {59, 0}, {0, 86}, {60, 87}};
+	for (auto& offset : offsets) {
+		PNG clipped = Crop(canvas, 0, 0, input.width(), input.height());
+		PNG clippedExpected = clipped;
+		Paste(clippedExpected, t.Render(3), offset[0], offset[1]);
+		t.RenderInto(clipped, offset[0], offset[1], 3, 4);
+		cout << "x3 at (" << offset[0] << ", " << offset[1] << ") " << (clipped == clippedExpected ? "matches" : "differs from") << " Render, clipped." << endl;
+	}
+
+	// write output PNG
+	t.RenderInto(canvas, 3, 5, 2);
+	u.RenderInto(canvas, 2 * input.width() + 7, 0, 2);
+	canvas.writeToFile("images-output/malachi-kkkk-atlas_x2.png");
+
+	cout << "Exiting TestRenderInto.\n" << endl;
+}
+
+void TestRenderRegion() {
+	cout << "Entered TestRenderRegion" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	// the whole image, a window, one pixel, one straddling the right and bottom edges, and one past them
+	unsigned int regions[][4] = {{0, 0, 255, 223}, {37, 101, 150, 170}, {128, 112, 128, 112}, {200, 190, 300, 250}, {256, 224, 270, 240}};
+	unsigned int scales[] = {1, 3};
+	for (auto& r : regions) {
+		for (unsigned int scale : scales) {
+			PNG expected = Crop(t.Render(scale), r[0] * scale, r[1] * scale, (r[2] - r[0] + 1) * scale, (r[3] - r[1] + 1) * scale);
+			bool same = t.RenderRegion(r[0], r[1], r[2], r[3], scale) == expected && t.RenderRegion(r[0], r[1], r[2], r[3], scale, 4) == expected;
+			cout << "Region (" << r[0] << ", " << r[1] << ")-(" << r[2] << ", " << r[3] << ") at x" << scale << " " << (same ? "matches" : "differs from") << " the crop of Render." << endl;
+		}
+	}
+
+	// write output PNG
+	t.RenderRegion(37, 101, 150, 170, 3).writeToFile("images-output/kkkk_nnkm-region_x3.png");
+
+	cout << "Exiting TestRenderRegion.\n" << endl;
+}
+
+void TestRenderLOD() {
+	cout << "Entered TestRenderLOD" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	// a 64 x 64 crop blown up x4, so every 4 x 4 node of the 256 x 256 tree is one colour
+	PNG small = Crop(input, 100, 80, 64, 64);
+	PNG blocks(256, 256);
+	for (unsigned int y = 0; y < blocks.height(); y++) {
+		for (unsigned int x = 0; x < blocks.width(); x++) {
+			*blocks.getPixel(x, y) = *small.getPixel(x / 4, y / 4);
+		}
+	}
+
+	cout << "Constructing QTrees from image... ";
+	QTree t(blocks);
+	QTree pruned(blocks);
+	pruned.Prune(0.05);
+	cout << "done." << endl;
+
+	// below the deepest leaf, RenderLOD is Render
+	bool same = t.RenderLOD(8) == t.Render(1) && t.RenderLOD(20, 3, 4) == t.Render(3) && pruned.RenderLOD(8, 2) == pruned.Render(2);
+	cout << "RenderLOD at full depth " << (same ? "matches" : "differs from") << " Render." << endl;
+
+	// the 4 x 4 nodes at depth 6 are uniform, so stopping there changes nothing
+	cout << "RenderLOD(6) " << (t.RenderLOD(6) == t.Render(1) ? "matches" : "differs from") << " Render on uniform 4 x 4 blocks." << endl;
+
+	// each scaled pixel repeats the x1 pixel under it
+	bool scaled = true;
+	for (unsigned int depth = 0; depth <= 8; depth += 2) {
+		PNG one = t.RenderLOD(depth);
+		PNG three = t.RenderLOD(depth, 3, 4);
+		for (unsigned int y = 0; y < three.height(); y++) {
+			for (unsigned int x = 0; x < three.width(); x++) {
+				scaled = scaled && *three.getPixel(x, y) == *one.getPixel(x / 3, y / 3);
+			}
+		}
+	}
+	cout << "RenderLOD x3 " << (scaled ? "matches" : "differs from") << " RenderLOD x1 scaled up." << endl;
+
+	// shrinking by the block size gives back the crop, and by 1 gives Render
+	cout << "RenderDownscaled(4) " << (t.RenderDownscaled(4) == small ? "matches" : "differs from") << " the crop it was blown up from." << endl;
+	cout << "RenderDownscaled(1) " << (t.RenderDownscaled(1) == t.Render(1) ? "matches" : "differs from") << " Render." << endl;
+
+	// on a 256 x 256 tree, the nodes covering one sample of RenderDownscaled(2^k) are
+	// the 2^k x 2^k nodes at depth 8 - k, which RenderLOD paints over their blocks
+	const QTree* trees[] = {&t, &pruned};
+	string names[] = {"full tree", "pruned tree"};
+	for (int i = 0; i < 2; i++) {
+		bool sampled = true;
+		for (unsigned int k = 1; k <= 5; k++) {
+			unsigned int divisor = 1u << k;
+			PNG down = trees[i]->RenderDownscaled(divisor);
+			PNG lod = trees[i]->RenderLOD(8 - k);
+			sampled = sampled && down.width() == 256 / divisor && down.height() == 256 / divisor;
+			for (unsigned int y = 0; sampled && y < down.height(); y++) {
+				for (unsigned int x = 0; x < down.width(); x++) {
+					sampled = sampled && *down.getPixel(x, y) == *lod.getPixel(x * divisor, y * divisor);
+				}
+			}
+		}
+		cout << names[i] << ": RenderDownscaled(2^k) " << (sampled ? "matches" : "differs from") << " RenderLOD(8 - k) sampled every 2^k pixels." << endl;
+	}
+
+	// write output PNGs
+	t.RenderLOD(4, 2).writeToFile("images-output/kkkk_nnkm-blocks-lod4_x2.png");
+	t.RenderDownscaled(8).writeToFile("images-output/kkkk_nnkm-blocks-down8.png");
+
+	cout << "Exiting TestRenderLOD.\n" << endl;
+}
+
+void TestRenderIncremental() {
+	cout << "Entered TestRenderIncremental" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	// the first call draws everything
+	PNG previous;
+	t.RenderIncremental(previous, 2);
+	cout << "First call " << (previous == t.Render(2) ? "matches" : "differs from") << " Render." << endl;
+
+	// with nothing dirty nothing is repainted, so a mark left on the image stays
+	RGBAPixel mark(255, 0, 255, 0.5);
+	*previous.getPixel(10, 10) = mark;
+	t.RenderIncremental(previous, 2);
+	cout << "Call with nothing dirty " << (*previous.getPixel(10, 10) == mark ? "leaves" : "repaints") << " the image." << endl;
+	*previous.getPixel(10, 10) = *t.Render(2).getPixel(10, 10);
+
+	// after each prune, the repainted image is a full render of the pruned tree
+	QTree reference(input);
+	t.Prune(0.01);
+	reference.Prune(0.01);
+	t.RenderIncremental(previous, 2, 4);
+	cout << "After Prune(0.01): incremental render " << (previous == reference.Render(2) ? "matches" : "differs from") << " a full render." << endl;
+
+	t.PruneTo(0.05);
+	reference.PruneTo(0.05);
+	t.RenderIncremental(previous, 2, 4);
+	cout << "After PruneTo(0.05): incremental render " << (previous == reference.Render(2) ? "matches" : "differs from") << " a full render." << endl;
+
+	// a flip changes the whole image
+	t.FlipHorizontal();
+	reference.FlipHorizontal();
+	t.RenderIncremental(previous, 2);
+	cout << "After FlipHorizontal: incremental render " << (previous == reference.Render(2) ? "matches" : "differs from") << " a full render." << endl;
+
+	// an image of the wrong size is drawn in full
+	PNG wrongSize(5, 5);
+	t.RenderIncremental(wrongSize, 2);
+	cout << "Image of the wrong size " << (wrongSize == reference.Render(2) ? "is" : "is not") << " rendered in full." << endl;
+
+	// write output PNG
+	previous.writeToFile("images-output/kkkk_nnkm-incremental_x2.png");
+
+	cout << "Exiting TestRenderIncremental.\n" << endl;
+}
+
+void TestRenderSize() {
+	cout << "Entered TestRenderSize" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+	unsigned int width = input.width();
+	unsigned int height = input.height();
+
+	// whole multiples are Render, and whole divisors RenderDownscaled
+	unsigned int scales[] = {1, 3};
+	for (unsigned int scale : scales) {
+		bool same = t.RenderSize(width * scale, height * scale) == t.Render(scale) && t.RenderSize(width * scale, height * scale, 4) == t.Render(scale);
+		cout << "RenderSize(" << width * scale << ", " << height * scale << ") " << (same ? "matches" : "differs from") << " Render(" << scale << ")." << endl;
+	}
+	unsigned int divisors[] = {2, 4, 8, 16, 32};
+	for (unsigned int divisor : divisors) {
+		bool same = t.RenderSize(width / divisor, height / divisor, 4) == t.RenderDownscaled(divisor);
+		cout << "RenderSize(" << width / divisor << ", " << height / divisor << ") " << (same ? "matches" : "differs from") << " RenderDownscaled(" << divisor << ")." << endl;
+	}
+
+	// enlarged along both axes, each pixel shows the leaf under its centre
+	PNG render = t.Render(1);
+	unsigned int sizes[][2] = {{300, 500}, {1920, 1080}, {257, 224}};
+	for (auto& size : sizes) {
+		PNG expected(size[0], size[1]);
+		for (unsigned int y = 0; y < size[1]; y++) {
+			for (unsigned int x = 0; x < size[0]; x++) {
+				unsigned int column = (2ULL * x + 1) * width / (2ULL * size[0]);
+				unsigned int row = (2ULL * y + 1) * height / (2ULL * size[1]);
+				*expected.getPixel(x, y) = *render.getPixel(column, row);
+			}
+		}
+		bool same = t.RenderSize(size[0], size[1]) == expected && t.RenderSize(size[0], size[1], 4) == expected;
+		cout << "RenderSize(" << size[0] << ", " << size[1] << ") " << (same ? "matches" : "differs from") << " Render(1) sampled at pixel centres." << endl;
+	}
+
+	// shrunk along either axis, threads share out the rows without changing them
+	unsigned int shrunk[][2] = {{100, 70}, {512, 100}, {37, 400}};
+	for (auto& size : shrunk) {
+		bool same = t.RenderSize(size[0], size[1]) == t.RenderSize(size[0], size[1], 4);
+		cout << "RenderSize(" << size[0] << ", " << size[1] << ") with 4 threads " << (same ? "matches" : "differs from") << " 1 thread." << endl;
+	}
+
+	// write output PNG
+	t.RenderSize(1920, 1080).writeToFile("images-output/kkkk_nnkm-1920x1080.png");
+
+	cout << "Exiting TestRenderSize.\n" << endl;
+}
+
+void TestRenderToFile() {
+	cout << "Entered TestRenderToFile" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	// an odd-sized crop, opaque and translucent
+	PNG crop(61, 37);
+	for (unsigned int y = 0; y < crop.height(); y++) {
+		for (unsigned int x = 0; x < crop.width(); x++) {
+			*crop.getPixel(x, y) = *input.getPixel(x + 90, y + 70);
+		}
+	}
+
+	QTree full(input);             // few enough colours for a palette
+	QTree pruned(input);           // too many for one, all opaque
+	pruned.Prune(0.01);
+	QTree faded(WithAlphaRamp(input));  // translucent leaves
+	faded.Prune(0.02);
+	QTree odd(crop);
+	QTree oddFaded(WithAlphaRamp(crop));
+
+	const QTree* trees[] = {&full, &pruned, &faded, &odd, &oddFaded};
+	string names[] = {"full tree", "pruned tree", "translucent tree", "61x37 tree", "translucent 61x37 tree"};
+
+	// x8 renders are several megabytes of rows, so they are deflated in several parts
+	unsigned int scales[] = {1, 3, 8};
+	for (int i = 0; i < 5; i++) {
+		for (unsigned int scale : scales) {
+			string outfilename = "images-output/kkkk_nnkm-tofile_x" + to_string(scale) + ".png";
+			string reffilename = "images-output/kkkk_nnkm-tofile_x" + to_string(scale) + "-reference.png";
+			trees[i]->RenderToFile(outfilename, scale, 4);
+
+			// Render, with its alpha stored as a file stores it
+			PNG expected = trees[i]->Render(scale);
+			expected.writeToFile(reffilename);
+			expected.readFromFile(reffilename);
+
+			PNG written;
+			written.readFromFile(outfilename);
+			cout << names[i] << " x" << scale << ": file " << (written == expected ? "matches" : "differs from") << " Render." << endl;
+		}
+	}
+
+	// a view paints the interior nodes a prune would collapse
+	PrunedView view = faded.View(0.05);
+	view.RenderToFile("images-output/kkkk_nnkm-tofile-view.png", 2);
+	PNG expected = view.Render(2);
+	expected.writeToFile("images-output/kkkk_nnkm-tofile-view-reference.png");
+	expected.readFromFile("images-output/kkkk_nnkm-tofile-view-reference.png");
+	PNG written;
+	written.readFromFile("images-output/kkkk_nnkm-tofile-view.png");
+	cout << "View x2: file " << (written == expected ? "matches" : "differs from") << " Render." << endl;
+
+	cout << "Exiting TestRenderToFile.\n" << endl;
+}
+
+void TestPruneTo() {
+	cout << "Entered TestPruneTo" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	cout << "Constructing QTree from image... ";
+	QTree t(input);
+	cout << "done." << endl;
+
+	double tolerances[] = {0.01, 0.05, 0.1};
+	for (double tol : tolerances) {
+		QTree pruned(input);
+		pruned.Prune(tol);
+		PNG expected = pruned.Render(1);
+
+		cout << "Tolerance " << tol << ": RenderPruned " << (t.RenderPruned(tol) == expected ? "matches" : "differs from") << " Prune";
+
+		// successive PruneTo calls on the same tree
+		t.PruneTo(tol);
+		cout << ", PruneTo " << (t.Render(1) == expected && t.CountLeaves() == pruned.CountLeaves() ? "matches" : "differs from") << " Prune." << endl;
+	}
+
+	// a smaller tolerance keeps what is left; a larger one collapses more
+	QTree again(input);
+	double sequence[] = {0.05, 0.01, 0.1};
+	double largest = 0;
+	for (double tol : sequence) {
+		largest = max(largest, tol);
+		QTree pruned(input);
+		pruned.Prune(largest);
+
+		again.PruneTo(tol);
+		bool same = again.Render(1) == pruned.Render(1) && again.CountLeaves() == pruned.CountLeaves() && again.CountNodes() == pruned.CountNodes();
+		cout << "PruneTo(" << tol << ") in sequence " << (same ? "matches" : "differs from") << " Prune(" << largest << ")." << endl;
+	}
+
+	cout << "Exiting TestPruneTo.\n" << endl;
+}
+
+void TestPruneBudgets() {
+	cout << "Entered TestPruneBudgets" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	unsigned long budgets[] = {1, 100, 5000, 20000};
+	for (unsigned long budget : budgets) {
+		QTree t(input);
+		double error = t.PruneToLeafCount(budget);
+
+		// any smaller tolerance must leave more leaves than the budget
+		bool least = true;
+		if (error > 0) {
+			QTree finer(input);
+			finer.PruneTo(nextafter(error, 0.0));
+			least = finer.CountLeaves() > budget;
+		}
+		cout << "PruneToLeafCount(" << budget << ") leaves " << t.CountLeaves() << " leaves, " << (t.CountLeaves() <= budget ? "within" : "over") << " budget"
+		     << (least ? "" : ", not the least error") << "." << endl;
+
+		QTree b(input);
+		size_t bytes = budget * sizeof(Node);
+		b.PruneToBytes(bytes);
+		cout << "PruneToBytes(" << bytes << ") keeps " << b.CountNodes() * sizeof(Node) << " bytes of nodes, " << (b.CountNodes() * sizeof(Node) <= bytes ? "within" : "over") << " budget." << endl;
+	}
+
+	cout << "Exiting TestPruneBudgets.\n" << endl;
+}
+
+void TestPruneDistance() {
+	cout << "Entered TestPruneDistance" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	double tolerances[] = {0.01, 0.05};
+	for (double tol : tolerances) {
+		QTree pruned(input);
+		pruned.Prune(tol);
+
+		QTree policy(input);
+		policy.Prune<MaxAlphaDistance>(tol);
+		cout << "Tolerance " << tol << ": Prune<MaxAlphaDistance> " << (policy.Render(1) == pruned.Render(1) ? "matches" : "differs from") << " Prune." << endl;
+
+		QTree luma(input);
+		luma.Prune<LumaDistance>(tol);
+		cout << "Prune<LumaDistance> leaves " << luma.CountLeaves() << " of " << pruned.CountLeaves() << " leaves." << endl;
+	}
+
+	// the policy path against Prune, on the photo tiled out to 1024 x 1024
+	unsigned int size = 1024;
+	PNG large(size, size);
+	for (unsigned int y = 0; y < size; y++) {
+		for (unsigned int x = 0; x < size; x++) {
+			*large.getPixel(x, y) = *input.getPixel(x % input.width(), y % input.height());
+		}
+	}
+	QTree full(large);
+	for (double tol : tolerances) {
+		QTree pruned(full);
+		QTree policy(full);
+		double pruneMs = TimeMs([&]() { pruned.Prune(tol); });
+		double policyMs = TimeMs([&]() { policy.Prune<MaxAlphaDistance>(tol); });
+		cout << "Tolerance " << tol << " at " << size << "x" << size << ": Prune " << pruneMs << " ms, Prune<MaxAlphaDistance> " << policyMs << " ms, " << pruneMs / policyMs << "x, leaves " << (policy.CountLeaves() == pruned.CountLeaves() ? "match" : "differ") << "." << endl;
+	}
+
+	cout << "Exiting TestPruneDistance.\n" << endl;
+}
+
+void TestPrunedView() {
+	cout << "Entered TestPrunedView" << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/kkkk_nnkm-256x224.png");
+
+	QTree t(input);
+	unsigned int nodes = t.CountNodes();
+
+	double tolerances[] = {0.0, 0.01, 0.05};
+	for (double tol : tolerances) {
+		QTree pruned(input);
+		pruned.PruneTo(tol);
+
+		PrunedView view = t.View(tol);
+		bool same = view.Render(1) == pruned.Render(1) && view.CountLeaves() == pruned.CountLeaves() && view.CountNodes() == pruned.CountNodes();
+		cout << "Tolerance " << tol << ": View " << (same ? "matches" : "differs from") << " PruneTo." << endl;
+	}
+	cout << "Tree " << (t.CountNodes() == nodes ? "unchanged" : "changed") << " by View." << endl;
+
+	// leaf budgets on a full tree, after PruneTo and after Prune
+	QTree afterPruneTo(input);
+	afterPruneTo.PruneTo(0.02);
+	QTree afterPrune(input);
+	afterPrune.Prune(0.02);
+	const QTree* trees[] = {&t, &afterPruneTo, &afterPrune};
+	string names[] = {"full tree", "PruneTo(0.02)", "Prune(0.02)"};
+	for (int i = 0; i < 3; i++) {
+		unsigned long leaves = trees[i]->CountLeaves();
+		unsigned long budgets[] = {leaves - 1, leaves - 100, leaves / 2, 1};
+		bool within = true;
+		for (unsigned long budget : budgets) {
+			within = within && trees[i]->ViewToLeafCount(budget).CountLeaves() <= budget;
+		}
+		cout << "ViewToLeafCount on " << names[i] << " " << (within ? "stays within" : "exceeds") << " its budgets." << endl;
+	}
+
+	cout << "Exiting TestPrunedView.\n" << endl;
+}
+
+void TestExportTiles(unsigned int tileSize) {
+	cout << "Entered TestExportTiles, tile size: " << tileSize << endl;
+
+	// read input PNG
+	PNG input;
+	input.readFromFile("images-original/malachi-60x87.png");
+	QTree t(input);
+
+	string name = "images-output/malachi-tiles";
+	cout << "Exporting tiles up to x2... ";
+	bool written = t.ExportTiles(name, tileSize, 2, 2);
+	cout << (written ? "done." : "failed.") << endl;
+
+	// the descriptor gives the tile size and the size of the x2 level
+	ifstream descriptorFile(name + ".dzi");
+	string descriptor((istreambuf_iterator<char>(descriptorFile)), istreambuf_iterator<char>());
+	bool described = descriptor.find("TileSize=\"" + to_string(tileSize) + "\"") != string::npos &&
+		descriptor.find("Format=\"png\"") != string::npos &&
+		descriptor.find("<Size Width=\"" + to_string(2 * input.width()) + "\" Height=\"" + to_string(2 * input.height()) + "\"/>") != string::npos;
+	cout << "Descriptor " << (described ? "describes" : "does not describe") << " the x2 level in " << tileSize << "-pixel tiles." << endl;
+
+	// levels as ExportTiles numbers them: halvings down to one pixel, then x1 and x2
+	unsigned int shrinkLevels = 0;
+	while ((max(input.width(), input.height()) - 1) >> shrinkLevels) {
+		shrinkLevels++;
+	}
+
+	for (unsigned int level = 0; level <= shrinkLevels + 1; level++) {
+		unsigned int divisor = level < shrinkLevels ? 1u << (shrinkLevels - level) : 1;
+		unsigned int scale = level <= shrinkLevels ? 1 : 2;
+		PNG expected = divisor > 1 ? t.RenderDownscaled(divisor) : t.Render(scale);
+
+		// stitch the level's tiles back together
+		PNG stitched(expected.width(), expected.height());
+		for (unsigned int top = 0; top < expected.height(); top += tileSize) {
+			for (unsigned int left = 0; left < expected.width(); left += tileSize) {
+				PNG tile;
+				tile.readFromFile(name + "_files/" + to_string(level) + "/" + to_string(left / tileSize) + "_" + to_string(top / tileSize) + ".png");
+				for (unsigned int y = 0; y < tile.height() && top + y < stitched.height(); y++) {
+					for (unsigned int x = 0; x < tile.width() && left + x < stitched.width(); x++) {
+						*stitched.getPixel(left + x, top + y) = *tile.getPixel(x, y);
+					}
+				}
+			}
+		}
+
+		string reference = divisor > 1 ? "RenderDownscaled(" + to_string(divisor) + ")" : "Render(" + to_string(scale) + ")";
+		cout << "Level " << level << " tiles " << (stitched == expected ? "match " : "differ from ") << reference << "." << endl;
+	}
+
+	cout << "Exiting TestExportTiles.\n" << endl;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file nodepool.cpp
+ * @description implementation of NodePool, the slab allocator that owns
+ *              the nodes of a QTree
+ *              CPSC 221 PA3
+ */
+
+#include "nodepool.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include "qtree.h"
+
+const size_t NodePool::SUMS_SLAB_NODES = NodePool::SUMS_SLAB_BYTES / (sizeof(Node) + sizeof(NodeSums));
+
+namespace {
+
+void freeSlab(Node* slab, bool aligned) {
+    if (aligned) {
+        free(slab);
+    } else {
+        ::operator delete(slab);
+    }
+}
+
+}
+
+NodePool::NodePool() : current(nullptr), used(0), freeList(nullptr), keepSums(false) {
+}
+
+NodePool::~NodePool() {
+    for (size_t i = 0; i < slabs.size(); i++) {
+        freeSlab(slabs[i], keepSums);
+    }
+    for (size_t i = 0; i < spare.size(); i++) {
+        freeSlab(spare[i], keepSums);
+    }
+}
+
+size_t NodePool::slabNodes() const {
+    return keepSums ? SUMS_SLAB_NODES : SLAB_NODES;
+}
+
+Node* NodePool::newSlab() const {
+    if (!keepSums) {
+        return static_cast<Node*>(::operator new(SLAB_NODES * sizeof(Node)));
+    }
+    void* slab = nullptr;
+    if (posix_memalign(&slab, SUMS_SLAB_BYTES, SUMS_SLAB_BYTES) != 0) {
+        throw bad_alloc();
+    }
+    return static_cast<Node*>(slab);
+}
+
+void NodePool::KeepSums(bool keep) {
+    if (keep == keepSums) {
+        return;
+    }
+    // spare slabs have the other layout
+    for (size_t i = 0; i < spare.size(); i++) {
+        freeSlab(spare[i], keepSums);
+    }
+    spare.clear();
+    keepSums = keep;
+}
+
+bool NodePool::KeepsSums() const {
+    return keepSums;
+}
+
+NodeSums& NodePool::SumsOf(const Node* node) {
+    uintptr_t address = reinterpret_cast<uintptr_t>(node);
+    uintptr_t slab = address & ~static_cast<uintptr_t>(SUMS_SLAB_BYTES - 1);
+    size_t index = (address - slab) / sizeof(Node);
+    return reinterpret_cast<NodeSums*>(slab + SUMS_SLAB_NODES * sizeof(Node))[index];
+}
+
+Node* NodePool::Make(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, const RGBAPixel& a) {
+    void* slot;
+    if (freeList) {
+        slot = freeList;
+        freeList = freeList->NW;
+    } else {
+        if (!current || used == slabNodes()) {
+            if (spare.empty()) {
+                current = newSlab();
+            } else {
+                current = spare.back();
+                spare.pop_back();
+            }
+            slabs.push_back(current);
+            used = 0;
+        }
+        slot = current + used++;
+    }
+    Node* node = new (slot) Node(ul, lr, a);
+    if (keepSums) {
+        SumsOf(node) = NodeSums();
+    }
+    return node;
+}
+
+void NodePool::Release(Node* node) {
+    node->NW = freeList;
+    freeList = node;
+}
+
+void NodePool::Reset() {
+    spare.insert(spare.end(), slabs.begin(), slabs.end());
+    slabs.clear();
+    current = nullptr;
+    used = 0;
+    freeList = nullptr;
+}
+
+size_t NodePool::BytesReserved() const {
+    return (slabs.size() + spare.size()) * (keepSums ? SUMS_SLAB_BYTES : SLAB_NODES * sizeof(Node));
+}
+
+void NodePool::Splice(NodePool& other) {
+    slabs.insert(slabs.end(), other.slabs.begin(), other.slabs.end());
+    spare.insert(spare.end(), other.spare.begin(), other.spare.end());
+
+    if (other.freeList) {
+        Node* tail = other.freeList;
+        while (tail->NW) {
+            tail = tail->NW;
+        }
+        tail->NW = freeList;
+        freeList = other.freeList;
+    }
+
+    other.slabs.clear();
+    other.spare.clear();
+    other.current = nullptr;
+    other.used = 0;
+    other.freeList = nullptr;
+}
@@ -0,0 +1,118 @@
+/**
+ * @file nodepool.h
+ * @description declaration of NodePool, the slab allocator that owns
+ *              the nodes of a QTree
+ *              CPSC 221 PA3
+ */
+
+#ifndef _NODEPOOL_H_
+#define _NODEPOOL_H_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+class Node;
+
+/**
+ * Exact colour sums over the pixels of a node's rectangle: r * a, g * a,
+ * b * a and a, with alpha as a byte from 0 to 255. The pixel count is the
+ * rectangle's area, so it is not stored.
+ */
+struct NodeSums {
+    unsigned long long r;
+    unsigned long long g;
+    unsigned long long b;
+    unsigned long long a;
+};
+
+/**
+ * NodePool: hands out Nodes carved from large slabs of memory.
+ *
+ * Nodes are never deleted one by one. Release() puts a single node on a
+ * free list that later calls to Make() reuse, and Reset() drops every
+ * node at once by rewinding the pool while keeping its slabs for the next
+ * build or copy. The slabs themselves are freed when the pool is destroyed.
+ *
+ * Node has a trivial destructor, so dropping nodes without running a
+ * destructor is safe.
+ *
+ * A pool can also keep a NodeSums beside every node it makes. Its slabs
+ * are then aligned to their own size and hold the nodes followed by their
+ * sums, so a node's sums are found from its address alone.
+ */
+class NodePool {
+public:
+    NodePool();
+
+    /**
+     * Frees every slab; all nodes made by this pool become invalid.
+     */
+    ~NodePool();
+
+    /**
+     * Constructs a node in the pool, reusing a released node if there is one.
+     * The arguments are those of the Node constructor.
+     */
+    Node* Make(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, const RGBAPixel& a);
+
+    /**
+     * Returns a single node to the free list. Its children are not touched.
+     */
+    void Release(Node* node);
+
+    /**
+     * Sets whether nodes made from now on carry a NodeSums, found with
+     * SumsOf. Must only change while the pool holds no nodes.
+     */
+    void KeepSums(bool keep);
+
+    bool KeepsSums() const;
+
+    /**
+     * The sums kept beside a node made by a pool that keeps sums. They
+     * start at zero.
+     */
+    static NodeSums& SumsOf(const Node* node);
+
+    /**
+     * Drops every node at once. Slabs are kept for reuse.
+     */
+    void Reset();
+
+    /**
+     * Takes ownership of every slab and released node of other, which is
+     * left empty. Used to merge pools filled by different threads.
+     * Both pools must agree on KeepsSums.
+     */
+    void Splice(NodePool& other);
+
+    /**
+     * Bytes held by the pool's slabs, in use or not.
+     */
+    size_t BytesReserved() const;
+
+private:
+    static const size_t SLAB_NODES = 1024; // nodes per slab
+    static const size_t SUMS_SLAB_BYTES = 1 << 17;  // size, and alignment, of a slab whose nodes carry sums
+    static const size_t SUMS_SLAB_NODES;            // nodes per such slab
+
+    size_t slabNodes() const;
+    Node* newSlab() const;
+
+    vector<Node*> slabs;  // slabs holding live (or released) nodes
+    vector<Node*> spare;  // empty slabs kept by Reset
+    Node* current;        // slab that new nodes are carved from, or null
+    size_t used;          // nodes carved from current so far
+    Node* freeList;       // released nodes, linked through their NW pointers
+    bool keepSums;        // whether slabs hold a NodeSums per node
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+};
+
+#endif
@@ -0,0 +1,435 @@
+/**
+ * @file pngstream.cpp
+ * @description implementation of PNGStream, a PNG writer that encodes an
+ *              image one row at a time
+ *              CPSC 221 PA3
+ */
+
+#include "pngstream.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include "cs221util/lodepng/lodepng.h"
+
+namespace {
+    // extra bits of deflate length symbols 257..285 and of distance codes 0..29
+    const unsigned int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                          3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    const unsigned int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                            8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    // reads a deflate stream lowest bit first, as it was written
+    struct BitReader {
+        const unsigned char* data;
+        size_t bitSize;
+        size_t position;  // in bits
+        bool overrun;     // set once a read goes past the end
+
+        BitReader(const unsigned char* d, size_t n) : data(d), bitSize(n * 8), position(0), overrun(false) {
+        }
+
+        unsigned int Read(unsigned int count) {
+            if (position + count > bitSize) {
+                overrun = true;
+                position = bitSize;
+                return 0;
+            }
+            unsigned int value = 0;
+            for (unsigned int i = 0; i < count; i++, position++) {
+                value |= ((data[position >> 3] >> (position & 7)) & 1) << i;
+            }
+            return value;
+        }
+    };
+
+    // decodes a canonical Huffman code from its code lengths, a bit at a
+    // time: the codes of each length are consecutive, in symbol order
+    struct Decoder {
+        unsigned int counts[16];
+        vector<unsigned int> symbols;  // in code order
+
+        Decoder(const unsigned int* lengths, size_t n) {
+            fill(counts, counts + 16, 0);
+            for (size_t i = 0; i < n; i++) {
+                counts[lengths[i]]++;
+            }
+            counts[0] = 0;
+            for (unsigned int length = 1; length < 16; length++) {
+                for (size_t i = 0; i < n; i++) {
+                    if (lengths[i] == length) {
+                        symbols.push_back(i);
+                    }
+                }
+            }
+        }
+
+        // returns n, past every symbol, if no code matches
+        unsigned int Decode(BitReader& in) const {
+            unsigned int code = 0, first = 0, index = 0;
+            for (unsigned int length = 1; length < 16 && !in.overrun; length++) {
+                code |= in.Read(1);
+                if (code - first < counts[length]) {
+                    return symbols[index + code - first];
+                }
+                index += counts[length];
+                first = (first + counts[length]) << 1;
+                code <<= 1;
+            }
+            return ~0u;
+        }
+    };
+
+    /**
+     * Walks the deflate stream in data, as lodepng_deflate makes it, block
+     * by block without decompressing it, and finds the bit at which its
+     * last block starts and the bit just past that block's end of block code.
+     * @return false if the stream is malformed
+     */
+    bool findLastBlock(const unsigned char* data, size_t n, size_t& lastStart, size_t& end) {
+        BitReader in(data, n);
+        while (!in.overrun) {
+            size_t start = in.position;
+            unsigned int final = in.Read(1);
+            unsigned int type = in.Read(2);
+
+            if (type == 0) {
+                in.Read((8 - in.position % 8) % 8);
+                unsigned int length = in.Read(16);
+                in.Read(16);
+                in.position += 8 * static_cast<size_t>(length);
+            } else if (type == 1 || type == 2) {
+                vector<unsigned int> lengths(320, 0);  // literal/length codes, then distance codes from 288
+                if (type == 1) {
+                    fill(lengths.begin(), lengths.begin() + 144, 8);
+                    fill(lengths.begin() + 144, lengths.begin() + 256, 9);
+                    fill(lengths.begin() + 256, lengths.begin() + 280, 7);
+                    fill(lengths.begin() + 280, lengths.begin() + 288, 8);
+                    fill(lengths.begin() + 288, lengths.end(), 5);
+                } else {
+                    unsigned int literals = in.Read(5) + 257;
+                    unsigned int distances = in.Read(5) + 1;
+                    unsigned int sent = in.Read(4) + 4;
+                    const unsigned int order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+                    unsigned int lengthLengths[19] = {0};
+                    for (unsigned int i = 0; i < sent; i++) {
+                        lengthLengths[order[i]] = in.Read(3);
+                    }
+                    Decoder lengthCode(lengthLengths, 19);
+
+                    // code lengths, run-length coded with 16 (repeat the previous), 17 and 18 (zeros)
+                    vector<unsigned int> sentLengths;
+                    while (sentLengths.size() < literals + distances && !in.overrun) {
+                        unsigned int symbol = lengthCode.Decode(in);
+                        if (symbol < 16) {
+                            sentLengths.push_back(symbol);
+                        } else if (symbol == 16 && !sentLengths.empty()) {
+                            sentLengths.insert(sentLengths.end(), 3 + in.Read(2), sentLengths.back());
+                        } else if (symbol == 17) {
+                            sentLengths.insert(sentLengths.end(), 3 + in.Read(3), 0);
+                        } else if (symbol == 18) {
+                            sentLengths.insert(sentLengths.end(), 11 + in.Read(7), 0);
+                        } else {
+                            return false;
+                        }
+                    }
+                    if (sentLengths.size() != literals + distances) {
+                        return false;
+                    }
+                    copy(sentLengths.begin(), sentLengths.begin() + literals, lengths.begin());
+                    copy(sentLengths.begin() + literals, sentLengths.end(), lengths.begin() + 288);
+                }
+
+                Decoder literalCode(lengths.data(), 288);
+                Decoder distanceCode(lengths.data() + 288, 32);
+                while (!in.overrun) {
+                    unsigned int symbol = literalCode.Decode(in);
+                    if (symbol == 256) {
+                        break;
+                    }
+                    if (symbol > 285) {
+                        return false;
+                    }
+                    if (symbol > 256) {
+                        in.Read(lengthExtra[symbol - 257]);
+                        unsigned int distance = distanceCode.Decode(in);
+                        if (distance >= 30) {
+                            return false;
+                        }
+                        in.Read(distanceExtra[distance]);
+                    }
+                }
+            } else {
+                return false;
+            }
+
+            if (final) {
+                lastStart = start;
+                end = in.position;
+                return !in.overrun;
+            }
+        }
+        return false;
+    }
+
+    void putBigEndian(vector<unsigned char>& out, unsigned int value) {
+        out.push_back(value >> 24);
+        out.push_back((value >> 16) & 0xff);
+        out.push_back((value >> 8) & 0xff);
+        out.push_back(value & 0xff);
+    }
+
+    // the RGBA8 bytes of a pixel, packed r first, as a palette key
+    unsigned int packColour(const RGBAPixel& pixel) {
+        return pixel.r | (pixel.g << 8) | (pixel.b << 16) | (static_cast<unsigned int>(static_cast<unsigned char>(pixel.a * 255)) << 24);
+    }
+}
+
+PNGStream::PNGStream() : width(0), channels(4), rowsLeft(0), bits(0), bitCount(0), adlerA(1), adlerB(0) {
+}
+
+PNGStream::~PNGStream() {
+    if (file.is_open()) {
+        file.close();
+    }
+}
+
+bool PNGStream::Open(const string& fileName, unsigned int w, unsigned int h, bool alpha,
+                     const vector<RGBAPixel>& palette) {
+    file.open(fileName.c_str(), ios::binary | ios::trunc);
+    if (!file) {
+        cerr << "PNG encoder error: cannot open " << fileName << endl;
+        return false;
+    }
+
+    width = w;
+    channels = !palette.empty() ? 1 : alpha ? 4 : 3;
+    rowsLeft = h;
+    current.assign(static_cast<size_t>(width) * channels, 0);
+    previous.assign(static_cast<size_t>(width) * channels, 0);
+    filtered.clear();
+    filtered.reserve(DEFLATE_BYTES + current.size() + 1);
+
+    const unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    file.write(reinterpret_cast<const char*>(signature), 8);
+
+    // 8 bits per channel, colour type 3 (palette), 6 (RGBA) or 2 (RGB), deflate,
+    // adaptive filtering, no interlace
+    vector<unsigned char> header;
+    putBigEndian(header, w);
+    putBigEndian(header, h);
+    header.push_back(8);
+    header.push_back(!palette.empty() ? 3 : alpha ? 6 : 2);
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+    WriteChunk("IHDR", header.data(), header.size());
+
+    // translucent colours go first, so tRNS can stop at the last of them
+    if (!palette.empty()) {
+        vector<RGBAPixel> colours(palette);
+        stable_partition(colours.begin(), colours.end(), [](const RGBAPixel& p) { return p.a * 255 < 255; });
+
+        indices.clear();
+        vector<unsigned char> entries, alphas;
+        for (size_t i = 0; i < colours.size(); i++) {
+            indices[packColour(colours[i])] = static_cast<unsigned char>(i);
+            entries.push_back(colours[i].r);
+            entries.push_back(colours[i].g);
+            entries.push_back(colours[i].b);
+            if (colours[i].a * 255 < 255) {
+                alphas.push_back(static_cast<unsigned char>(colours[i].a * 255));
+            }
+        }
+        WriteChunk("PLTE", entries.data(), entries.size());
+        if (!alphas.empty()) {
+            WriteChunk("tRNS", alphas.data(), alphas.size());
+        }
+    }
+
+    // zlib header for a 32K window and no dictionary
+    pending.push_back(0x78);
+    pending.push_back(0x01);
+    return true;
+}
+
+void PNGStream::WriteRow(const RGBAPixel* row) {
+    unsigned char* out = current.data();
+    if (channels == 1) {
+        // rows are runs of one colour, so the last lookup is usually the answer
+        unsigned int lastColour = 0;
+        unsigned char lastIndex = 0;
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned int colour = packColour(row[x]);
+            if (x == 0 || colour != lastColour) {
+                lastColour = colour;
+                lastIndex = indices[colour];
+            }
+            out[x] = lastIndex;
+        }
+    } else {
+        for (unsigned int x = 0; x < width; x++, out += channels) {
+            out[0] = row[x].r;
+            out[1] = row[x].g;
+            out[2] = row[x].b;
+            if (channels == 4) {
+                out[3] = row[x].a * 255;
+            }
+        }
+    }
+
+    FilterRow();
+    if (filtered.size() >= DEFLATE_BYTES) {
+        Deflate(false);
+    }
+
+    swap(current, previous);
+    rowsLeft--;
+}
+
+bool PNGStream::Close() {
+    Deflate(true);
+    if (bitCount > 0) {
+        PutBits(0, 8 - bitCount);
+    }
+
+    putBigEndian(pending, (adlerB << 16) | adlerA);
+    WriteChunk("IDAT", pending.data(), pending.size());
+    pending.clear();
+    WriteChunk("IEND", nullptr, 0);
+
+    file.close();
+    return !file.fail() && rowsLeft == 0;
+}
+
+namespace {
+    // the Paeth predictor of the PNG specification: whichever of left, up
+    // and upLeft is closest to left + up - upLeft
+    unsigned char paeth(int left, int up, int upLeft) {
+        int p = left + up - upLeft;
+        int pa = abs(p - left), pb = abs(p - up), pc = abs(p - upLeft);
+        return (pa <= pb && pa <= pc) ? left : (pb <= pc) ? up : upLeft;
+    }
+}
+
+/**
+ * Picks the filter with the smallest sum of absolute differences, the
+ * usual heuristic, as lodepng does; for flat rectangles, Sub zeroes the
+ * inside of each span and Up zeroes a row that repeats the one above.
+ * Palette indices are not numbers to take differences of, so they are
+ * left unfiltered.
+ */
+void PNGStream::FilterRow() {
+    size_t n = current.size();
+    if (channels == 1) {
+        filtered.push_back(0);
+        filtered.insert(filtered.end(), current.begin(), current.end());
+        return;
+    }
+
+    // the filtered byte i under each filter type, None, Sub, Up, Average and Paeth
+    auto filter = [this](unsigned int type, size_t i) -> unsigned char {
+        unsigned char left = i >= channels ? current[i - channels] : 0;
+        unsigned char upLeft = i >= channels ? previous[i - channels] : 0;
+        switch (type) {
+            case 1: return current[i] - left;
+            case 2: return current[i] - previous[i];
+            case 3: return current[i] - (left + previous[i]) / 2;
+            case 4: return current[i] - paeth(left, previous[i], upLeft);
+            default: return current[i];
+        }
+    };
+
+    unsigned int best = 0;
+    unsigned long bestCost = ~0ul;
+    for (unsigned int type = 0; type < 5; type++) {
+        unsigned long cost = 0;
+        for (size_t i = 0; i < n && cost < bestCost; i++) {
+            cost += abs(static_cast<signed char>(filter(type, i)));
+        }
+        if (cost < bestCost) {
+            best = type;
+            bestCost = cost;
+        }
+    }
+
+    filtered.push_back(best);
+    for (size_t i = 0; i < n; i++) {
+        filtered.push_back(filter(best, i));
+    }
+}
+
+/**
+ * lodepng ends what it deflates with a final block, so unless the stream
+ * ends here too, that block's final bit is cleared. Its blocks are not
+ * padded to a byte between calls, so the next call's bits follow on
+ * straight after this one's end of block code.
+ */
+void PNGStream::Deflate(bool final) {
+    const unsigned char* data = filtered.data();
+    size_t n = filtered.size();
+
+    // the sums cannot overflow within 5552 bytes, so they are reduced once per block
+    for (size_t start = 0; start < n; start += 5552) {
+        size_t end = min(n, start + 5552);
+        for (size_t i = start; i < end; i++) {
+            adlerA += data[i];
+            adlerB += adlerA;
+        }
+        adlerA %= 65521;
+        adlerB %= 65521;
+    }
+
+    LodePNGCompressSettings settings;
+    lodepng_compress_settings_init(&settings);
+    unsigned char* out = nullptr;
+    size_t outSize = 0;
+    size_t lastStart = 0, end = 0;
+    if (lodepng_deflate(&out, &outSize, data, n, &settings) != 0 || !findLastBlock(out, outSize, lastStart, end)) {
+        file.setstate(ios::badbit);
+        free(out);
+        filtered.clear();
+        return;
+    }
+
+    if (!final) {
+        out[lastStart / 8] &= ~(1 << (lastStart % 8));
+    }
+    for (size_t i = 0; i < end / 8; i++) {
+        PutBits(out[i], 8);
+    }
+    if (end % 8 > 0) {
+        PutBits(out[end / 8] & ((1 << (end % 8)) - 1), end % 8);
+    }
+    free(out);
+    filtered.clear();
+
+    if (pending.size() >= CHUNK_BYTES) {
+        WriteChunk("IDAT", pending.data(), pending.size());
+        pending.clear();
+    }
+}
+
+void PNGStream::PutBits(unsigned long value, unsigned int count) {
+    bits |= value << bitCount;
+    bitCount += count;
+    while (bitCount >= 8) {
+        pending.push_back(bits & 0xff);
+        bits >>= 8;
+        bitCount -= 8;
+    }
+}
+
+/**
+ * lodepng lays out the chunk and computes its CRC.
+ */
+void PNGStream::WriteChunk(const char* type, const unsigned char* data, size_t n) {
+    unsigned char* chunk = nullptr;
+    size_t size = 0;
+    if (lodepng_chunk_create(&chunk, &size, n, type, data) == 0) {
+        file.write(reinterpret_cast<const char*>(chunk), size);
+    } else {
+        file.setstate(ios::badbit);
+    }
+    free(chunk);
+}
@@ -0,0 +1,118 @@
+/**
+ * @file pngstream.h
+ * @description declaration of PNGStream, a PNG writer that encodes an
+ *              image one row at a time
+ *              CPSC 221 PA3
+ */
+
+#ifndef _PNGSTREAM_H_
+#define _PNGSTREAM_H_
+
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * PNGStream: writes an 8-bit RGBA, RGB or palette PNG file whose rows are
+ * handed over one at a time, top to bottom, so the whole image never has
+ * to be in memory.
+ *
+ * Each row is filtered with whichever of the None, Sub and Up filters
+ * leaves the smallest bytes; palette rows are not filtered, as lodepng
+ * and the PNG specification advise. Filtered rows are collected and
+ * deflated about a megabyte at a time by lodepng_deflate, and the blocks
+ * it makes are joined into the one zlib stream a PNG holds: each call's
+ * output is walked to find where its last block starts and ends, that
+ * block's final bit is cleared unless the image is done, and its bits
+ * are appended where the previous call's left off. Compressed data is
+ * written out in IDAT chunks, made by lodepng, as it fills up.
+ *
+ * Alpha is stored as a * 255, truncated, as in PNG::writeToFile.
+ */
+class PNGStream {
+public:
+    PNGStream();
+
+    /**
+     * Closes the file if it is still open; the image is left incomplete.
+     */
+    ~PNGStream();
+
+    /**
+     * Creates fileName and writes the PNG header for a width x height image.
+     * @param alpha whether to keep alpha; if not, the image is stored as RGB
+     *              and the rows' alpha is dropped, so they should be opaque
+     * @param palette if not empty, at most 256 colours, which must include
+     *                every pixel of the rows; the image is then stored as
+     *                indices into it, with alpha if any colour has it
+     * @return false if the file could not be created
+     */
+    bool Open(const string& fileName, unsigned int width, unsigned int height, bool alpha = true,
+              const vector<RGBAPixel>& palette = vector<RGBAPixel>());
+
+    /**
+     * Encodes the next row of the image.
+     * @param row the row's width pixels
+     */
+    void WriteRow(const RGBAPixel* row);
+
+    /**
+     * Finishes the image and closes the file. Every row must have been written.
+     * @return false if any write to the file failed
+     */
+    bool Close();
+
+private:
+    static const size_t CHUNK_BYTES = 1 << 16;    // compressed bytes collected before an IDAT chunk is written
+    static const size_t DEFLATE_BYTES = 1 << 20;  // filtered bytes collected before they are deflated
+
+    ofstream file;
+    unsigned int width;
+    unsigned int channels;  // bytes per pixel: 4 for RGBA, 3 for RGB, 1 for a palette index
+    unsigned int rowsLeft;  // rows still to be written
+
+    unordered_map<unsigned int, unsigned char> indices;  // palette index of each packed RGBA8 colour
+
+    vector<unsigned char> current;   // the row being encoded, as RGBA8, RGB8 or index bytes
+    vector<unsigned char> previous;  // the row before it, for the Up filter
+    vector<unsigned char> filtered;  // filtered rows not yet deflated, each a filter type byte and the row
+
+    vector<unsigned char> pending;  // compressed bytes not yet written
+    unsigned long bits;             // bits not yet moved to pending, lowest first
+    unsigned int bitCount;          // number of bits in bits
+    unsigned int adlerA;            // Adler-32 of the uncompressed data
+    unsigned int adlerB;
+
+    PNGStream(const PNGStream&) = delete;
+    PNGStream& operator=(const PNGStream&) = delete;
+
+    /**
+     * Filters the row in current onto the end of filtered.
+     */
+    void FilterRow();
+
+    /**
+     * Deflates the rows in filtered and appends them to the stream; if
+     * lodepng cannot, the file is marked as failed.
+     * @param final whether they end the stream
+     */
+    void Deflate(bool final);
+
+    /**
+     * Appends the lowest count bits of value, lowest first.
+     */
+    void PutBits(unsigned long value, unsigned int count);
+
+    /**
+     * Writes a chunk with the given type and data, with its length and CRC.
+     */
+    void WriteChunk(const char* type, const unsigned char* data, size_t n);
+};
+
+#endif
@@ -49,14 +49,18 @@ QTree::QTree(const QTree& other) {
  * Counts the number of nodes in the tree
  */
 unsigned int QTree::CountNodes() const {
-	return CountNodes(root);
+	unsigned long nodes = stats.nodes, leaves = stats.leaves;
+	unbuiltCounts(nodes, leaves);
+	return nodes;
 }
 
 /**
  * Counts the number of leaves in the tree
  */
 unsigned int QTree::CountLeaves() const {
-	return CountLeaves(root);
+	unsigned long nodes = stats.nodes, leaves = stats.leaves;
+	unbuiltCounts(nodes, leaves);
+	return leaves;
 }
 
 /**
@@ -24,22 +24,385 @@
 
 // begin your declarations below
 
-RGBAPixel calculateAverageColour(Node* node);
+mutable NodePool nodePool; // owns every node of this tree; const calls on a lazy tree add nodes
 
-void renderNode(PNG & img, Node* node, unsigned int scale) const;
+/**
+ * Read-only view of the image a tree is built from: either the pixel
+ * array of a PNG, or rows of packed RGBA8 bytes.
+ */
+struct PixelSource {
+    PixelSource();
+    PixelSource(const PNG& img);
+    PixelSource(const unsigned char* rgba, unsigned int w, unsigned int h, size_t rowStride);
+
+    const RGBAPixel* pixels;     // PNG pixels, or null for RGBA8 rows
+    const unsigned char* bytes;  // RGBA8 rows, used when pixels is null
+    size_t stride;               // distance between rows, in pixels or in bytes
+    unsigned int width;
+    unsigned int height;
+
+    // pixel (x, y), converted from RGBA8 the same way PNG::readFromFile does
+    RGBAPixel At(unsigned int x, unsigned int y) const {
+        if (pixels) {
+            return pixels[x + y * stride];
+        }
+        const unsigned char* p = bytes + y * stride + 4 * static_cast<size_t>(x);
+        return RGBAPixel(p[0], p[1], p[2], p[3] / 255.);
+    }
+};
+
+/**
+ * Range of each channel (r, g, b, a) over the pixels of a region, with a
+ * pixel that holds each extreme value.
+ */
+struct RegionBounds {
+    // a pixel's channels, kept as plain data so bounds are cheap to copy
+    struct Sample {
+        unsigned char r, g, b;
+        double a;
+
+        RGBAPixel Pixel() const { return RGBAPixel(r, g, b, a); }
+    };
+
+    double low[4];
+    double high[4];
+    Sample lowPixel[4];
+    Sample highPixel[4];
+
+    void Reset(const RGBAPixel& pixel);
+    void Add(const RGBAPixel& pixel);
+    void Merge(const RegionBounds& other);
+
+    // upper bound on pixel.distanceTo(avg) over every pixel in the bounds
+    double MaxDistanceTo(const RGBAPixel& avg) const;
+
+    // if the bounds alone settle whether every pixel is within tolerance of
+    // avg, stores the answer in within and returns true
+    bool Decides(const RGBAPixel& avg, double tolerance, bool& within) const;
+};
+
+/**
+ * A change Prune makes once all of its decisions are known: node, at the
+ * given depth, collapses into a leaf, or, if it is a stub that is kept,
+ * is built further.
+ */
+struct PruneStep {
+    Node* node;
+    unsigned int depth;
+    bool collapse;
+};
+
+/**
+ * PrepareColors, ColorsWithinTolerance and BoundsDecide for the distance
+ * policy a Prune<Distance> call was made with.
+ */
+typedef void (*ColorPreparer)(const RGBAPixel* pixels, size_t count, DistanceColor* out);
+typedef bool (*ColorTester)(const DistanceColor* colors, size_t count, const DistanceColor& avg,
+                            double tolerance);
+typedef bool (*BoundsDecider)(const ColorBounds& bounds, const DistanceColor& avg, double tolerance, bool& within);
+
+struct DistanceKernels {
+    ColorPreparer prepare;
+    ColorTester within;
+    BoundsDecider decide;
+};
+
+/**
+ * A node the budget prunes may collapse. The priority queue pops the
+ * smallest threshold first and, among equal ones, the deepest node,
+ * which removes the fewest leaves.
+ */
+struct MergeCandidate {
+    double threshold;
+    unsigned int depth;
+    Node* node;
+
+    bool operator<(const MergeCandidate& other) const {
+        return threshold > other.threshold || (threshold == other.threshold && depth < other.depth);
+    }
+};
+
+PixelSource source;                          // pixels a lazy tree builds from
+unsigned int lazyDepth = 0;                 // levels a lazy tree builds at a time; 0 if not lazy
+mutable unordered_map<const Node*, unsigned int> stubs;  // leaves of a lazy tree whose subtrees are not yet built, with their depths
+
+// the smallest tolerance at which Prune collapses each interior node: the largest
+// distanceTo from a leaf below it to its average; empty until PruneTo or
+// RenderPruned first needs it
+mutable unordered_map<const Node*, double> thresholds;
+
+mutable TreeStats stats;  // kept up to date as nodes are added and removed; bytes is filled in by Stats()
+
+// threads of the parallel builds and renders, started by the first of them
+// and kept for the next ones that ask for as many threads
+mutable shared_ptr<WorkPool> workPool;
+mutable mutex workPoolLock;  // guards workPool
+
+/**
+ * Returns this tree's pool of the given number of threads, replacing the
+ * kept one if it has a different number. Calls that use different numbers
+ * of threads must not overlap.
+ */
+WorkPool& pool(unsigned int threads) const;
+
+static const unsigned int DIRTY_CELL = 32;  // side, in Render(1) pixels, of the cells changes are tracked in
+
+// one flag per DIRTY_CELL x DIRTY_CELL cell of Render(1), row-major, set if the cell's
+// rendering changed since the last RenderIncremental; empty if no cell is set
+vector<bool> dirtyCells;
+bool allDirty = true;  // set when the whole image changed
+
+/**
+ * Records that the rendering of node's rectangle changed.
+ */
+void markDirty(const Node* node);
+
+/**
+ * Summed-area table of an image's alpha-weighted channels, giving the
+ * exact sums, and so the exact average, of any rectangle in O(1).
+ */
+struct SumTable {
+    vector<unsigned long long> totals;  // 4 sums per entry, (width + 1) x (height + 1) entries
+    size_t columns;                     // entries per row, width + 1
+
+    void Fill(const PixelSource& src);
+    NodeSums Sums(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+};
+
+// sums of the image a lazy tree with exact averages builds from, for the regions of its stubs
+shared_ptr<const SumTable> sums;
+
+/**
+ * The averages BuildNode gives the regions of an image at every depth.
+ * The nodes at depth d form a grid of the intervals splitAxis lists for
+ * d, and each grid is reduced from the one below it.
+ */
+struct LevelAverages {
+    vector<vector<unsigned int> > xStarts, xFirsts;  // splitAxis of the width
+    vector<vector<unsigned int> > yStarts, yFirsts;  // splitAxis of the height
+    vector<vector<unsigned char> > r, g, b;           // each depth's averages, one per grid cell, row-major
+
+    void Fill(const PixelSource& src);
+    RGBAPixel Average(pair<unsigned int, unsigned int> ul, unsigned int depth) const;
+};
+
+// averages of the image a lazy tree without exact averages builds from, for the regions of its stubs
+shared_ptr<const LevelAverages> averages;
+
+void Build(const PixelSource& src, const BuildOptions& options);
+
+Node* BuildEager(const PixelSource& src, const BuildOptions& options);
+
+RGBAPixel nodeAverage(Node* node) const;
+
+NodeSums nodeSums(const Node* node) const;
+
+static NodeSums pixelSums(const RGBAPixel& pixel);
+
+static RGBAPixel sumsAverage(const NodeSums& total, unsigned long long area);
+
+RGBAPixel calculateAverageColour(Node* node) const;
+
+/**
+ * Where renderNode draws: a row-major pixel array, the placement of the
+ * tree's pixel (0, 0) on it, and the rectangle [left, right) x [top, bottom)
+ * of the array that may be written.
+ */
+struct Canvas {
+    RGBAPixel* pixels;
+    unsigned int width;   // pixels per row
+    unsigned int left;
+    unsigned int top;
+    unsigned int right;
+    unsigned int bottom;
+    long long offsetX;    // may be negative when the canvas shows a window into the render
+    long long offsetY;
+    unsigned int scale;
+    unsigned int maxDepth;  // nodes at this depth are drawn as leaves
+    double tolerance;       // if >= 0, nodes whose prune threshold is at most this are drawn as leaves
+};
+
+void renderNode(const Canvas& canvas, Node* node, unsigned int depth) const;
+
+void renderNodeScales(const vector<Canvas>& canvases, Node* node, unsigned int top, unsigned int bottom) const;
+
+/**
+ * Where renderNodeBytes draws: the whole render as packed 8-bit pixels,
+ * of which only rows [top, bottom) may be written.
+ */
+struct ByteCanvas {
+    unsigned char* pixels;
+    size_t stride;          // bytes from one row to the next
+    unsigned int channels;  // 4 for RGBA, 3 for RGB
+    unsigned int scale;
+    unsigned int top;
+    unsigned int bottom;
+};
+
+void renderBytes(unsigned char* pixels, size_t stride, unsigned int channels, unsigned int scale,
+                 unsigned int threads) const;
+
+void renderNodeBytes(const ByteCanvas& canvas, Node* node) const;
+
+bool paintsOpaque(Node* node, unsigned int depth, unsigned int maxDepth, double tolerance) const;
+
+void paintedColours(Node* node, unsigned int depth, unsigned int maxDepth, double tolerance, size_t limit,
+                    unordered_map<unsigned int, RGBAPixel>& colours) const;
+
+/**
+ * Where sampleNode draws: one sample point of the render per column and
+ * per row of the whole output, in non-decreasing order (when the output
+ * is larger than the render, neighbouring pixels share samples), and the
+ * window of that output held in a row-major pixel array. Whether a node
+ * covers a single output pixel is decided on the whole output, so a
+ * window shows exactly what the whole output shows there. The samples
+ * are not owned, so every window of one output can share them.
+ */
+struct Sampler {
+    RGBAPixel* pixels;                    // output pixel (left, top)
+    unsigned int width;                   // pixels per row of the array
+    const vector<unsigned int>* columns;  // x coordinate in the render sampled by each output column
+    const vector<unsigned int>* rows;     // y coordinate in the render sampled by each output row
+    unsigned int left, top;        // first output column and row in the window
+    unsigned int right, bottom;    // one past the last
+};
+
+void sampleNode(const Sampler& sampler, Node* node) const;
+
+static vector<unsigned int> downscaleSamples(unsigned int size, unsigned int divisor);
+
+void sampleInto(PNG& target, const vector<unsigned int>& columns, const vector<unsigned int>& rows,
+                unsigned int left, unsigned int top) const;
+
+static bool makeDirectory(const string& path);
+
+void renderCanvas(PNG& target, long long offsetX, long long offsetY, unsigned int scale,
+                  unsigned int threads, unsigned int maxDepth = ~0u, double tolerance = -1) const;
+
+void forEachBand(unsigned int rows, unsigned int threads, const function<void(unsigned int, unsigned int)>& fn,
+                 unsigned int minBandRows = 16) const;
+
+void repaintDirty(PNG& target, unsigned int scale, unsigned int threads);
 
 void flipHorizontalHelper(Node* node, unsigned int imageWidth);
 
-void clearHelper(Node* node);
+void clearHelper(Node* node, unsigned int depth);
 
-Node* copyHelper(Node* otherNode);
+Node* copyHelper(Node* otherNode, const unordered_map<const Node*, unsigned int>& otherStubs,
+                 const unordered_map<const Node*, double>& otherThresholds);
 
 void rotateCCWHelper(Node* node, unsigned int imageWidth, unsigned int imageHeight);
 
-void pruneHelper(Node* node, double tolerance);
+void pruneHelper(Node* node, double tolerance, unsigned int depth);
+
+bool pruneBounds(Node* node, double tolerance, unsigned int depth, RegionBounds& bounds,
+                 vector<PruneStep>& steps);
+
+void settlePrune(const PruneStep& step, double tolerance);
 
 bool allLeavesWithinTolerance(Node* node, const RGBAPixel& avg, double tolerance);
 
-bool isLeaf(Node* node);
+void pruneWith(double tolerance, const DistanceKernels& kernels);
+
+bool colorBounds(Node* node, unsigned int depth, double tolerance, const DistanceKernels& kernels,
+                 ColorBounds& bounds, vector<PruneStep>& steps, vector<RGBAPixel>& leaves,
+                 vector<DistanceColor>& colors);
+
+void listLeaves(Node* node, vector<RGBAPixel>& leaves) const;
+
+void pruneToHelper(Node* node, double tolerance, unsigned int depth);
+
+double pruneToBudget(unsigned long maxLeaves, unsigned long maxNodes);
+
+void collectCandidates(Node* node, unsigned int depth, vector<MergeCandidate>& candidates) const;
+
+double toleranceForLeaves(unsigned long maxLeaves) const;
+
+void leafIntervals(Node* node, double above, vector<pair<double, int> >& events) const;
+
+void countView(Node* node, double tolerance, unsigned long& nodes, unsigned long& leaves) const;
+
+bool writeRender(const string& fileName, unsigned int scale, unsigned int threads, double tolerance) const;
+
+void indexThresholds() const;
+
+double thresholdHelper(Node* node, RegionBounds& bounds) const;
+
+double maxLeafDistance(Node* node, const RGBAPixel& avg, double best) const;
+
+double pruneThreshold(const Node* node) const;
+
+bool isLeaf(Node* node) const;
+
+void splitRect(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+               pair<unsigned int, unsigned int> childUL[4], pair<unsigned int, unsigned int> childLR[4],
+               bool present[4]) const;
+
+Node* BuildNode(const PixelSource& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                NodePool& nodes, unsigned int depth, TreeStats& counts);
+
+static void splitAxis(unsigned int length, unsigned int depth,
+                      vector<vector<unsigned int> >& starts, vector<vector<unsigned int> >& firsts);
+
+Node* BuildPyramid(const PixelSource& src, NodePool& nodes, TreeStats& counts);
+
+/**
+ * A region as BuildNodeMerged works it out: its average, with its sums if
+ * the tree keeps them, the channel ranges of its pixels, and its subtree,
+ * or null if the whole region merges into a leaf not yet made.
+ */
+struct MergedRegion {
+    Node* node;
+    RGBAPixel avg;
+    NodeSums total;
+    RegionBounds bounds;
+};
+
+Node* BuildNodeParallel(const PixelSource& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                        WorkPool& workers, NodePool& nodes, unsigned long cutoff,
+                        double tolerance, unsigned int depth, TreeStats& counts, MergedRegion* region);
+
+void BuildNodeMerged(const PixelSource& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                     NodePool& nodes, double tolerance, unsigned int depth, TreeStats& counts,
+                     MergedRegion& region);
+
+void mergeRegions(const PixelSource& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                  NodePool& nodes, double tolerance, unsigned int depth, TreeStats& counts,
+                  const MergedRegion children[4], const bool present[4],
+                  const pair<unsigned int, unsigned int> childUL[4], const pair<unsigned int, unsigned int> childLR[4],
+                  MergedRegion& region);
+
+Node* mergedNode(const MergedRegion& region, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                 NodePool& nodes, unsigned int depth, TreeStats& counts) const;
+
+bool regionWithinTolerance(const PixelSource& src, pair<unsigned int, unsigned int> ul,
+                           pair<unsigned int, unsigned int> lr, const RegionBounds& bounds,
+                           const RGBAPixel& avg, double tolerance) const;
+
+void releaseHelper(Node* node, NodePool& nodes, unsigned int depth, TreeStats& counts);
+
+bool pixelsWithinTolerance(const PixelSource& src, pair<unsigned int, unsigned int> ul,
+                           pair<unsigned int, unsigned int> lr, const RGBAPixel& avg, double tolerance) const;
+
+Node* BuildNodeLazy(const PixelSource& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                    NodePool& nodes, unsigned int levels, unsigned int depth) const;
+
+RGBAPixel regionAverage(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                        unsigned int depth) const;
+
+bool isStub(const Node* node) const;
+
+void expandStub(Node* node) const;
+
+void materializeHelper(Node* node) const;
+
+static void countNode(TreeStats& counts, unsigned int depth, bool leaf);
+
+static void addCounts(TreeStats& counts, const TreeStats& more);
+
+void unbuiltCounts(unsigned long& nodes, unsigned long& leaves) const;
+
+static unsigned long fullNodes(unsigned int w, unsigned int h, unordered_map<unsigned long long, unsigned long>& memo);
+
 
 void updateCurrentNodeBounds(Node* node);
\ No newline at end of file
@@ -7,6 +7,19 @@
  */
 
 #include "qtree.h"
+#include "workpool.h"
+#include "pngstream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <vector>
+#include <sys/stat.h>
 
 /**
  * Constructor that builds a QTree out of the given PNG.
@@ -49,6 +62,45 @@ QTree::QTree(const PNG& imIn) {
 	root = BuildNode(imIn, make_pair(0, 0), make_pair(width - 1, height - 1));
 }
 
+/**
+ * Constructor that builds the same QTree as QTree(const PNG&), with
+ * the given build options.
+ *
+ * With more than one thread, the NW, NE, SW and SE subtrees of every
+ * region of at least options.cutoff pixels are built as separate tasks
+ * on a work-stealing pool. A node's average is still computed from its
+ * children once they are all finished, so the averages are exactly
+ * the ones the sequential build produces.
+ *
+ * With options.pyramid, the tree is instead built bottom-up: the image
+ * is read row by row into the leaves, and each level of the tree is
+ * then reduced from the level below it, a row of nodes at a time.
+ *
+ * @param imIn the image to decompose
+ * @param options build options
+ */
+QTree::QTree(const PNG& imIn, const BuildOptions& options) {
+    Build(PixelSource(imIn), options);
+}
+
+/**
+ * Constructor that builds a QTree straight from packed RGBA8 pixels,
+ * without decoding them into a PNG first. Each pixel is 4 bytes, in
+ * R, G, B, A order, and alpha byte a becomes a / 255.0, exactly as in
+ * PNG::readFromFile; so the tree is the one QTree(const PNG&) builds
+ * from the same pixels. The buffer is only read during construction.
+ *
+ * @param rgba first byte of the top row of pixels
+ * @param w width of the image, in pixels
+ * @param h height of the image, in pixels
+ * @param stride distance in bytes between the starts of consecutive rows, at least 4 * w
+ * @param options build options, as for QTree(const PNG&, const BuildOptions&)
+ */
+QTree::QTree(const unsigned char* rgba, unsigned int w, unsigned int h, size_t stride,
+             const BuildOptions& options) {
+    Build(PixelSource(rgba, w, h, stride), options);
+}
+
 
 /**
  * Overloaded assignment operator for QTrees.
@@ -83,10 +135,15 @@ QTree& QTree::operator=(const QTree& rhs) {
  * For up-scaled images, no color interpolation will be done;
  * each rectangle is fully rendered into a larger rectangular region.
  *
+ * With more than one thread, the image is split into horizontal bands
+ * that are drawn at the same time. Each pixel is still written by
+ * exactly one leaf, so the result is the same as with one thread.
+ *
  * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing the image, including the caller
  * @pre scale > 0
  */
-PNG QTree::Render(unsigned int scale) const {
+PNG QTree::Render(unsigned int scale, unsigned int threads) const {
     if (!root) {
         return PNG();  // empty image
     }
@@ -97,11 +154,220 @@ PNG QTree::Render(unsigned int scale) const {
     PNG img(newWidth, newHeight);
 
     // render each leaf node
-    renderNode(img, root, scale);
+    RenderInto(img, 0, 0, scale, threads);
+
+    return img;
+}
 
+/**
+ * Draws the tree into an existing image, the way Render draws it into a
+ * new one, with pixel (0, 0) of the render placed at (offsetX, offsetY).
+ * Only the pixels covered by the render are written; anything that
+ * falls outside target is clipped. Nothing is allocated.
+ *
+ * @param target image to draw into
+ * @param offsetX column of target where the render's left edge goes
+ * @param offsetY row of target where the render's top edge goes
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing the image, including the caller
+ */
+void QTree::RenderInto(PNG& target, unsigned int offsetX, unsigned int offsetY, unsigned int scale,
+                       unsigned int threads) const {
+    renderCanvas(target, offsetX, offsetY, scale, threads);
+}
+
+/**
+ * Renders the part of the tree that covers the rectangle from (x0, y0) to
+ * (x1, y1), inclusive, in the coordinates of Render(1). The result is
+ * the matching crop of Render(scale): (x1 - x0 + 1) * scale pixels wide
+ * and (y1 - y0 + 1) * scale tall. Subtrees whose rectangles miss the
+ * region are skipped without being visited, so the cost depends on the
+ * size of the region and the leaves that cover it, not on the whole tree.
+ * Any part of the region outside the tree's image keeps PNG's default colour.
+ *
+ * @param x0 left column of the region
+ * @param y0 top row of the region
+ * @param x1 right column of the region
+ * @param y1 bottom row of the region
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing the image, including the caller, as for Render
+ * @pre x0 <= x1, y0 <= y1, scale > 0
+ */
+PNG QTree::RenderRegion(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1, unsigned int scale,
+                        unsigned int threads) const {
+    PNG img((x1 - x0 + 1) * scale, (y1 - y0 + 1) * scale);
+    renderCanvas(img, -static_cast<long long>(x0) * scale, -static_cast<long long>(y0) * scale, scale, threads);
     return img;
 }
 
+/**
+ * Shared body of RenderInto and RenderRegion: draws the tree onto target
+ * with its pixel (0, 0) at (offsetX, offsetY), which may lie off target.
+ */
+void QTree::renderCanvas(PNG& target, long long offsetX, long long offsetY, unsigned int scale,
+                         unsigned int threads, unsigned int maxDepth, double tolerance) const {
+    if (!root || target.width() == 0 || target.height() == 0 || scale == 0) {
+        return;
+    }
+
+    Canvas canvas;
+    canvas.pixels = target.getPixel(0, 0);
+    canvas.width = target.width();
+    canvas.left = 0;
+    canvas.top = 0;
+    canvas.right = target.width();
+    canvas.bottom = target.height();
+    canvas.offsetX = offsetX;
+    canvas.offsetY = offsetY;
+    canvas.scale = scale;
+    canvas.maxDepth = maxDepth;
+    canvas.tolerance = tolerance;
+
+    // every band walks the tree from the root but only descends into nodes
+    // that reach it, and writes only its own rows
+    forEachBand(canvas.bottom - canvas.top, threads, [this, &canvas](unsigned int top, unsigned int bottom) {
+        Canvas band = canvas;
+        band.top = canvas.top + top;
+        band.bottom = canvas.top + bottom;
+        renderNode(band, root, 0);
+    });
+}
+
+/**
+ * Splits rows [0, rows) into horizontal bands and calls fn(top, bottom)
+ * once per band, each as a task on this tree's pool of the given number of
+ * threads. The caller draws the first band itself and returns once every
+ * band is done. There are several bands per thread so that a thread whose
+ * bands hold few leaves can steal another's; fn must only write the rows
+ * of its band, so the bands need no locks. With one thread, with too few
+ * rows for more than one band, or on a lazy tree, which builds stubs as it
+ * renders and so must stay on one thread, fn(0, rows) is called directly.
+ */
+void QTree::forEachBand(unsigned int rows, unsigned int threads,
+                        const function<void(unsigned int, unsigned int)>& fn,
+                        unsigned int minBandRows) const {
+    unsigned int bands = min(threads * 4, (rows + minBandRows - 1) / minBandRows);
+    if (threads <= 1 || !stubs.empty() || bands <= 1) {
+        fn(0, rows);
+        return;
+    }
+
+    WorkPool& workers = pool(threads);
+    WorkPool::TaskGroup group;
+    for (unsigned int i = 1; i < bands; i++) {
+        unsigned int top = static_cast<unsigned int>(static_cast<unsigned long long>(rows) * i / bands);
+        unsigned int bottom = static_cast<unsigned int>(static_cast<unsigned long long>(rows) * (i + 1) / bands);
+        workers.Spawn(group, [&fn, top, bottom]() {
+            fn(top, bottom);
+        });
+    }
+    fn(0, static_cast<unsigned int>(rows / bands));
+    workers.Wait(group);
+}
+
+/**
+ * Brings previous, the image left by the last call to RenderIncremental,
+ * up to date by repainting only the parts whose rendering changed
+ * since then: the regions collapsed by Prune, tracked in cells of 32 x 32
+ * pixels of Render(1). The first call renders it in full, as do calls after
+ * FlipHorizontal, RotateCCW or assignment, which change the whole image.
+ * It is also rendered in full if its size does not match the tree.
+ * Afterwards nothing is dirty, so the next call repaints only what
+ * changes after this one.
+ *
+ * @param previous the image to update in place
+ * @param scale the scale previous was rendered at
+ * @param threads threads repainting, including the caller, as for Render
+ * @pre scale > 0
+ */
+void QTree::RenderIncremental(PNG& previous, unsigned int scale, unsigned int threads) {
+    if (!root) {
+        previous = PNG();
+    } else if (allDirty || previous.width() != width * scale || previous.height() != height * scale) {
+        previous = Render(scale, threads);
+    } else {
+        repaintDirty(previous, scale, threads);
+    }
+
+    dirtyCells.clear();
+    allDirty = false;
+}
+
+/**
+ * Redraws the dirty cells of target. Each run of dirty cells along a row
+ * of cells is drawn as one clipped canvas; the runs never overlap, so they
+ * are drawn as separate tasks that need no locks.
+ */
+void QTree::repaintDirty(PNG& target, unsigned int scale, unsigned int threads) {
+    if (dirtyCells.empty()) {
+        return;
+    }
+
+    unsigned int columns = (width + DIRTY_CELL - 1) / DIRTY_CELL;
+    unsigned int rows = (height + DIRTY_CELL - 1) / DIRTY_CELL;
+
+    vector<Canvas> parts;
+    for (unsigned int row = 0; row < rows; row++) {
+        unsigned int column = 0;
+        while (column < columns) {
+            if (!dirtyCells[row * columns + column]) {
+                column++;
+                continue;
+            }
+            unsigned int first = column;
+            while (column < columns && dirtyCells[row * columns + column]) {
+                column++;
+            }
+
+            Canvas canvas;
+            canvas.pixels = target.getPixel(0, 0);
+            canvas.width = target.width();
+            canvas.left = first * DIRTY_CELL * scale;
+            canvas.top = row * DIRTY_CELL * scale;
+            canvas.right = min(column * DIRTY_CELL, width) * scale;
+            canvas.bottom = min((row + 1) * DIRTY_CELL, height) * scale;
+            canvas.offsetX = 0;
+            canvas.offsetY = 0;
+            canvas.scale = scale;
+            canvas.maxDepth = ~0u;
+            canvas.tolerance = -1;
+            parts.push_back(canvas);
+        }
+    }
+
+    // the runs take the place of rows, one run per band at least
+    forEachBand(parts.size(), threads, [this, &parts](unsigned int first, unsigned int last) {
+        for (unsigned int i = first; i < last; i++) {
+            renderNode(parts[i], root, 0);
+        }
+    }, 1);
+}
+
+WorkPool& QTree::pool(unsigned int threads) const {
+    lock_guard<mutex> guard(workPoolLock);
+    if (!workPool || workPool->Size() != max(threads, 1u)) {
+        workPool = make_shared<WorkPool>(threads);
+    }
+    return *workPool;
+}
+
+void QTree::markDirty(const Node* node) {
+    if (allDirty) {
+        return;
+    }
+
+    unsigned int columns = (width + DIRTY_CELL - 1) / DIRTY_CELL;
+    if (dirtyCells.empty()) {
+        dirtyCells.assign(static_cast<size_t>(columns) * ((height + DIRTY_CELL - 1) / DIRTY_CELL), false);
+    }
+
+    for (unsigned int row = node->upLeft.second / DIRTY_CELL; row <= node->lowRight.second / DIRTY_CELL; row++) {
+        for (unsigned int column = node->upLeft.first / DIRTY_CELL; column <= node->lowRight.first / DIRTY_CELL; column++) {
+            dirtyCells[static_cast<size_t>(row) * columns + column] = true;
+        }
+    }
+}
+
 /**
  *  Prune function trims subtrees as high as possible in the tree.
  *  A subtree is pruned (cleared) if all of the subtree's leaves are within
@@ -112,11 +378,88 @@ PNG QTree::Render(unsigned int scale) const {
  *
  * You may want a recursive helper function for this one.
  *
+ * Most nodes are settled in O(1) from the channel ranges of their leaves,
+ * merged up from their children. A node those ranges cannot settle has
+ * its leaves walked, so Prune is not linear: at worst it is O(n log n).
+ *
  * @param tolerance maximum RGBA distance to qualify for pruning
  * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
  */
 void QTree::Prune(double tolerance) {
-    pruneHelper(root, tolerance);
+    pruneHelper(root, tolerance, 0);
+}
+
+/**
+ * Prunes the tree to what Prune(tolerance) leaves, using the smallest
+ * tolerance at which each node collapses. These thresholds are computed
+ * once, by the first call to PruneTo or RenderPruned, from the leaves the
+ * tree has then (building any regions of a lazy tree not built yet), and
+ * are kept by copies. Each later call only visits the nodes it keeps and
+ * the ones it removes.
+ *
+ * Unlike Prune, PruneTo may be called any number of times. A larger
+ * tolerance than before collapses more; regions removed by an earlier
+ * call cannot come back, so a smaller one leaves them as they are.
+ *
+ * @param tolerance maximum RGBA distance to qualify for pruning
+ */
+void QTree::PruneTo(double tolerance) {
+    indexThresholds();
+    pruneToHelper(root, tolerance, 0);
+}
+
+/**
+ * Prunes the tree until it has at most maxLeaves leaves, collapsing the
+ * cheapest subtrees first: nodes are taken in increasing order of their
+ * prune threshold, as in PruneTo, from a priority queue, and each is
+ * collapsed unless an earlier one already removed it. Stopping as soon
+ * as the budget is met gives the least error any pruning within it can
+ * have: every tree PruneTo(t) leaves for a smaller t has more leaves.
+ * The thresholds are computed on first use, as for PruneTo.
+ *
+ * @param maxLeaves largest number of leaves wanted; the tree never goes below one
+ * @return the largest threshold of a node collapsed, 0 if none was
+ */
+double QTree::PruneToLeafCount(unsigned long maxLeaves) {
+    return pruneToBudget(maxLeaves, ~0ul);
+}
+
+/**
+ * Prunes the tree until its nodes take at most maxBytes bytes, at
+ * sizeof(Node) each, in the same order and with the same guarantee as
+ * PruneToLeafCount.
+ *
+ * @param maxBytes largest memory wanted for the nodes; the tree never goes below one node
+ * @return the largest threshold of a node collapsed, 0 if none was
+ */
+double QTree::PruneToBytes(size_t maxBytes) {
+    return pruneToBudget(~0ul, maxBytes / sizeof(Node));
+}
+
+/**
+ * Returns a view of the tree as PruneTo(tolerance) would leave it, without
+ * changing the tree. The view shares this tree's nodes and holds only the
+ * tolerance, so any number of views cost almost nothing. The thresholds
+ * are computed on first use, as for PruneTo.
+ *
+ * @param tolerance maximum RGBA distance to qualify for pruning
+ */
+PrunedView QTree::View(double tolerance) const {
+    indexThresholds();
+    return PrunedView(*this, tolerance);
+}
+
+/**
+ * Returns View(t) for the smallest tolerance t at which the view has at
+ * most maxLeaves leaves, found from the thresholds without changing the
+ * tree. Nodes sharing that threshold all collapse, so the view may have
+ * fewer leaves than PruneToLeafCount(maxLeaves) leaves, never more error.
+ *
+ * @param maxLeaves largest number of leaves wanted; the view never goes below one
+ */
+PrunedView QTree::ViewToLeafCount(unsigned long maxLeaves) const {
+    indexThresholds();
+    return PrunedView(*this, toleranceForLeaves(maxLeaves));
 }
 
 
@@ -136,9 +479,13 @@ void QTree::Prune(double tolerance) {
  */
 void QTree::FlipHorizontal() {
 
+    // stubs are built from their source rectangles, so build them first
+    materializeHelper(root);
+
     if (root) {
         flipHorizontalHelper(root, root->lowRight.first); 
     }
+    allDirty = true;
 
 }
 
@@ -184,11 +531,14 @@ void QTree::flipHorizontalHelper(Node* node, unsigned int imageWidth) {
  *  You may want a recursive helper function for this one.
  */
 void QTree::RotateCCW() {
+    materializeHelper(root);
+
     if (root) {
         rotateCCWHelper(root, width, height);
 		
     }
 	swap(width, height); // swap width and height
+    allDirty = true;
     
 
 }
@@ -243,9 +593,19 @@ void QTree::rotateCCWHelper(Node* node, unsigned int imageWidth, unsigned int im
  * Destroys all dynamically allocated memory associated with the
  * current QTree object. Complete for PA3.
  * You may want a recursive helper function for this one.
+ *
+ * Every node lives in nodePool, so the whole tree is dropped at once
+ * without visiting it; the pool keeps its slabs for the next Copy.
  */
 void QTree::Clear() {
-    clearHelper(root);
+    nodePool.Reset();
+    stubs.clear();
+    thresholds.clear();
+    sums.reset();
+    averages.reset();
+    stats = TreeStats();
+    dirtyCells.clear();
+    allDirty = true;
     root = nullptr; 
 }
 
@@ -256,7 +616,15 @@ void QTree::Clear() {
  * @param other The QTree to be copied.
  */
 void QTree::Copy(const QTree& other) {
-    root = copyHelper(other.root);
+    width = other.width;
+    height = other.height;
+    source = other.source;
+    lazyDepth = other.lazyDepth;
+    sums = other.sums;
+    averages = other.averages;
+    nodePool.KeepSums(other.nodePool.KeepsSums());
+    root = copyHelper(other.root, other.stubs, other.thresholds);
+    stats = other.stats;
 }
 
 /**
@@ -269,53 +637,43 @@ void QTree::Copy(const QTree& other) {
 
 
 Node* QTree::BuildNode(const PNG & img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
-    if (ul.first >= img.width() || ul.second >= img.height() || lr.first < ul.first || lr.second < ul.second) {
+    return BuildNode(PixelSource(img), ul, lr, nodePool, 0, stats);
+}
+
+/**
+ * BuildNode, reading pixels from src and allocating the subtree's nodes
+ * from the given pool. Each node is added to counts as it is made.
+ * @param depth depth of the node for (ul, lr)
+ */
+Node* QTree::BuildNode(const PixelSource& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                       NodePool& nodes, unsigned int depth, TreeStats& counts) {
+    if (ul.first >= src.width || ul.second >= src.height || lr.first < ul.first || lr.second < ul.second) {
         return nullptr;  
     }
 
 
     if (ul == lr) {
-        RGBAPixel* pixel = img.getPixel(ul.first, ul.second);
-        if (!pixel) {
-            return nullptr;
-        }
-        return new Node(ul, lr, *pixel);
+        countNode(counts, depth, true);
+        return nodes.Make(ul, lr, src.At(ul.first, ul.second));
     }
 
-    Node* node = new Node(ul, lr, RGBAPixel());
+    Node* node = nodes.Make(ul, lr, RGBAPixel());
     if (!node) {
         return nullptr;
     }
+    countNode(counts, depth, false);
 
-	width = lr.first - ul.first + 1;
-	height = lr.second - ul.second + 1;
-
+    pair<unsigned int, unsigned int> childUL[4], childLR[4];
+    bool present[4];
+    splitRect(ul, lr, childUL, childLR, present);
 
-    unsigned int midX = ul.first + width / 2;
-    unsigned int midY = ul.second + height / 2;
-
-    if (width % 2 == 0) midX--;
-    if (height % 2 == 0) midY--;
-
-    if (width == 1) {
-        node->NW = BuildNode(img, ul, make_pair(ul.first, midY));
-        node->SW = (height > 1) ? BuildNode(img, make_pair(ul.first, midY + 1), lr) : nullptr;
-        node->NE = nullptr;
-        node->SE = nullptr;
-    } else if (height == 1) {
-        node->NW = BuildNode(img, ul, make_pair(midX, ul.second));
-        node->NE = BuildNode(img, make_pair(midX + 1, ul.second), lr);
-        node->SW = nullptr;
-        node->SE = nullptr;
-    } else {
-        node->NW = BuildNode(img, ul, make_pair(midX, midY));
-        node->NE = BuildNode(img, make_pair(midX + 1, ul.second), make_pair(lr.first, midY));
-        node->SW = BuildNode(img, make_pair(ul.first, midY + 1), make_pair(midX, lr.second));
-        node->SE = BuildNode(img, make_pair(midX + 1, midY + 1), lr);
-    }
+    node->NW = present[0] ? BuildNode(src, childUL[0], childLR[0], nodes, depth + 1, counts) : nullptr;
+    node->NE = present[1] ? BuildNode(src, childUL[1], childLR[1], nodes, depth + 1, counts) : nullptr;
+    node->SW = present[2] ? BuildNode(src, childUL[2], childLR[2], nodes, depth + 1, counts) : nullptr;
+    node->SE = present[3] ? BuildNode(src, childUL[3], childLR[3], nodes, depth + 1, counts) : nullptr;
 
     if (node->NW || node->NE || node->SW || node->SE) {
-        node->avg = calculateAverageColour(node);
+        node->avg = nodeAverage(node);
     }
 
     return node;
@@ -329,7 +687,7 @@ Node* QTree::BuildNode(const PNG & img, pair<unsigned int, unsigned int> ul, pai
 /*** IMPLEMENT YOUR OWN PRIVATE MEMBER FUNCTIONS BELOW ***/
 /*********************************************************/
 
-RGBAPixel QTree::calculateAverageColour(Node* node) {
+RGBAPixel QTree::calculateAverageColour(Node* node) const {
     if (!node || isLeaf(node)) {
         return node ? node->avg : RGBAPixel();
     }
@@ -361,113 +719,2385 @@ RGBAPixel QTree::calculateAverageColour(Node* node) {
 }
 
 
-void QTree::renderNode(PNG & img, Node* node, unsigned int scale) const {
+/**
+ * Draws the leaves under node onto the canvas. The node's rectangle is
+ * clipped to the canvas first, so subtrees that land entirely outside it
+ * are skipped, and each leaf is filled one row span at a time. Nodes at
+ * canvas.maxDepth, and nodes Prune(canvas.tolerance) would collapse, are
+ * drawn as leaves.
+ * @param depth depth of node in the tree
+ */
+void QTree::renderNode(const Canvas& canvas, Node* node, unsigned int depth) const {
     if (!node) {
         return;
     }
 
+    // rectangle bounds of the node on the canvas, clipped to it
+    long long startX = canvas.offsetX + static_cast<long long>(node->upLeft.first) * canvas.scale;
+    long long startY = canvas.offsetY + static_cast<long long>(node->upLeft.second) * canvas.scale;
+    long long endX = canvas.offsetX + (node->lowRight.first + 1LL) * canvas.scale;
+    long long endY = canvas.offsetY + (node->lowRight.second + 1LL) * canvas.scale;
+    if (startX >= canvas.right || startY >= canvas.bottom || endX <= canvas.left || endY <= canvas.top) {
+        return;
+    }
+    startX = max<long long>(startX, canvas.left);
+    startY = max<long long>(startY, canvas.top);
+    endX = min<long long>(endX, canvas.right);
+    endY = min<long long>(endY, canvas.bottom);
+
+    // a stub already holds its average, so it is only built to go deeper
+    if (depth < canvas.maxDepth && isStub(node)) {
+        expandStub(node);
+    }
+
     // check if the node is a leaf node
-    if (!node->NW && !node->NE && !node->SW && !node->SE) {
-        // rectangle bounds of the node
-        unsigned int startX = node->upLeft.first * scale;
-        unsigned int startY = node->upLeft.second * scale;
-        unsigned int endX = (node->lowRight.first + 1) * scale;
-        unsigned int endY = (node->lowRight.second + 1) * scale;
-
-        // draw rectangle
-        for (unsigned int x = startX; x < endX; x++) {
-            for (unsigned int y = startY; y < endY; y++) {
-                if (x < img.width() && y < img.height()) {
-                    RGBAPixel *pixel = img.getPixel(x, y);
-                    *pixel = node->avg;
-            	}
-			}
+    if (depth >= canvas.maxDepth || (!node->NW && !node->NE && !node->SW && !node->SE) ||
+        (canvas.tolerance >= 0 && pruneThreshold(node) <= canvas.tolerance)) {
+        for (long long y = startY; y < endY; y++) {
+            RGBAPixel* row = canvas.pixels + y * canvas.width;
+            fill(row + startX, row + endX, node->avg);
         }
     } else {
         //  render child nodes
-        if (node->NW) renderNode(img, node->NW, scale);
-        if (node->NE) renderNode(img, node->NE, scale);
-        if (node->SW) renderNode(img, node->SW, scale);
-        if (node->SE) renderNode(img, node->SE, scale);
+        if (node->NW) renderNode(canvas, node->NW, depth + 1);
+        if (node->NE) renderNode(canvas, node->NE, depth + 1);
+        if (node->SW) renderNode(canvas, node->SW, depth + 1);
+        if (node->SE) renderNode(canvas, node->SE, depth + 1);
+    }
+}
+
+/**
+ * Renders the tree at each of the given scales in one traversal per
+ * band of rows: a leaf's colour is painted into all of the images at
+ * once. The result is the same as calling Render(scale) for each scale,
+ * in order.
+ *
+ * With one thread there is a single band, so every node is visited once.
+ * With more, the rows of the tree are split into bands as in Render, and
+ * every task walks the tree from the root to draw its band of rows in
+ * all the images; a node that spans several bands is visited by each of
+ * their tasks, though a leaf's rows are still drawn only once.
+ *
+ * @param scales multipliers for each horizontal/vertical dimension, one per image
+ * @param threads threads drawing the images, including the caller
+ * @pre every scale > 0
+ */
+vector<PNG> QTree::RenderScales(const vector<unsigned int>& scales, unsigned int threads) const {
+    vector<PNG> images(scales.size());
+    if (!root) {
+        return images;
+    }
+
+    unsigned int renderWidth = root->lowRight.first - root->upLeft.first + 1;
+    unsigned int renderHeight = root->lowRight.second - root->upLeft.second + 1;
+
+    vector<Canvas> canvases(scales.size());
+    for (size_t i = 0; i < scales.size(); i++) {
+        images[i] = PNG(renderWidth * scales[i], renderHeight * scales[i]);
+
+        canvases[i].pixels = images[i].getPixel(0, 0);
+        canvases[i].width = images[i].width();
+        canvases[i].left = 0;
+        canvases[i].top = 0;
+        canvases[i].right = images[i].width();
+        canvases[i].bottom = images[i].height();
+        canvases[i].offsetX = 0;
+        canvases[i].offsetY = 0;
+        canvases[i].scale = scales[i];
+        canvases[i].maxDepth = ~0u;
+        canvases[i].tolerance = -1;
+    }
+
+    // bands of rows of the tree
+    forEachBand(renderHeight, threads, [this, &canvases](unsigned int top, unsigned int bottom) {
+        renderNodeScales(canvases, root, top, bottom);
+    });
+
+    return images;
+}
+
+/**
+ * Draws the leaves under node that reach rows [top, bottom) of the tree
+ * onto every canvas. The canvases all show the whole tree, so a node is
+ * tested against the rows once, in the tree's coordinates, and a leaf's
+ * rectangle only has to be scaled for each canvas.
+ */
+void QTree::renderNodeScales(const vector<Canvas>& canvases, Node* node, unsigned int top,
+                             unsigned int bottom) const {
+    if (!node || node->upLeft.second >= bottom || node->lowRight.second < top) {
+        return;
+    }
+
+    if (isStub(node)) {
+        expandStub(node);
+    }
+
+    if (!node->NW && !node->NE && !node->SW && !node->SE) {
+        const RGBAPixel colour = node->avg;
+        unsigned int startY = max(node->upLeft.second, top);
+        unsigned int endY = min(node->lowRight.second + 1, bottom);
+        for (size_t i = 0; i < canvases.size(); i++) {
+            const Canvas& canvas = canvases[i];
+            RGBAPixel* row = canvas.pixels + static_cast<size_t>(startY) * canvas.scale * canvas.width;
+            RGBAPixel* rowsEnd = canvas.pixels + static_cast<size_t>(endY) * canvas.scale * canvas.width;
+            for (; row < rowsEnd; row += canvas.width) {
+                fill(row + node->upLeft.first * canvas.scale, row + (node->lowRight.first + 1) * canvas.scale, colour);
+            }
+        }
+        return;
     }
+
+    renderNodeScales(canvases, node->NW, top, bottom);
+    renderNodeScales(canvases, node->NE, top, bottom);
+    renderNodeScales(canvases, node->SW, top, bottom);
+    renderNodeScales(canvases, node->SE, top, bottom);
+}
+
+/**
+ * Renders the tree at the given scale straight into packed RGBA8 pixels,
+ * 4 bytes each in R, G, B, A order, with alpha stored as a * 255,
+ * truncated, exactly as PNG::writeToFile converts it. The bytes are those
+ * writeToFile would hand to lodepng for Render(scale), but no RGBAPixel
+ * image is built and there is no conversion pass.
+ *
+ * @param rgba first byte of the top row; the buffer must hold every row of the render
+ * @param stride distance in bytes between the starts of consecutive rows, at least 4 * width
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing the image, including the caller, as for Render
+ * @pre scale > 0
+ */
+void QTree::RenderRGBA8(unsigned char* rgba, size_t stride, unsigned int scale, unsigned int threads) const {
+    renderBytes(rgba, stride, 4, scale, threads);
 }
 
+/**
+ * Renders the tree at the given scale into bytes, replacing its contents,
+ * packed for lodepng::encode. If every leaf, which is every node the
+ * render paints, is opaque the pixels are RGB8, 3 bytes each, and the
+ * result is 3; otherwise they are RGBA8 as in RenderRGBA8, and the
+ * result is 4. Rows are packed with no padding.
+ *
+ * @param bytes receives the pixels
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing the image, including the caller, as for Render
+ * @pre scale > 0
+ * @return bytes per pixel: 3 for RGB (LCT_RGB), 4 for RGBA (LCT_RGBA)
+ */
+unsigned int QTree::RenderBytes(vector<unsigned char>& bytes, unsigned int scale, unsigned int threads) const {
+    if (!root) {
+        bytes.clear();
+        return 4;
+    }
+
+    // every leaf is drawn at full detail anyway, so a lazy tree is built up front
+    materializeHelper(root);
+    unsigned int channels = paintsOpaque(root, 0, ~0u, -1) ? 3 : 4;
 
+    size_t stride = static_cast<size_t>(root->lowRight.first - root->upLeft.first + 1) * scale * channels;
+    bytes.resize(stride * (root->lowRight.second - root->upLeft.second + 1) * scale);
+    if (!bytes.empty()) {
+        renderBytes(bytes.data(), stride, channels, scale, threads);
+    }
+    return channels;
+}
 
+/**
+ * Shared body of RenderRGBA8 and RenderBytes. With more than one thread,
+ * the rows are split into bands drawn as separate tasks by forEachBand.
+ */
+void QTree::renderBytes(unsigned char* pixels, size_t stride, unsigned int channels, unsigned int scale,
+                        unsigned int threads) const {
+    if (!root || scale == 0) {
+        return;
+    }
 
+    ByteCanvas canvas;
+    canvas.pixels = pixels;
+    canvas.stride = stride;
+    canvas.channels = channels;
+    canvas.scale = scale;
+    canvas.top = 0;
+    canvas.bottom = (root->lowRight.second - root->upLeft.second + 1) * scale;
+
+    forEachBand(canvas.bottom, threads, [this, &canvas](unsigned int top, unsigned int bottom) {
+        ByteCanvas band = canvas;
+        band.top = top;
+        band.bottom = bottom;
+        renderNodeBytes(band, root);
+    });
+}
 
-void QTree::clearHelper(Node* node) {
+/**
+ * Draws the leaves under node that reach the canvas's rows. A leaf's
+ * colour is packed once; its first row is filled a pixel at a time and
+ * the rest of its rows are copies of the first.
+ */
+void QTree::renderNodeBytes(const ByteCanvas& canvas, Node* node) const {
     if (!node) {
-        return; 
+        return;
     }
 
-    // recursively clear child nodes
-    clearHelper(node->NW);
-    clearHelper(node->NE);
-    clearHelper(node->SW);
-    clearHelper(node->SE);
+    unsigned int startY = max(node->upLeft.second * canvas.scale, canvas.top);
+    unsigned int endY = min((node->lowRight.second + 1) * canvas.scale, canvas.bottom);
+    if (startY >= endY) {
+        return;
+    }
+
+    if (isStub(node)) {
+        expandStub(node);
+    }
+
+    if (node->NW || node->NE || node->SW || node->SE) {
+        renderNodeBytes(canvas, node->NW);
+        renderNodeBytes(canvas, node->NE);
+        renderNodeBytes(canvas, node->SW);
+        renderNodeBytes(canvas, node->SE);
+        return;
+    }
 
-    delete node;
+    unsigned char colour[4] = {node->avg.r, node->avg.g, node->avg.b, static_cast<unsigned char>(node->avg.a * 255)};
+    size_t startX = static_cast<size_t>(node->upLeft.first) * canvas.scale * canvas.channels;
+    size_t spanBytes = static_cast<size_t>(node->lowRight.first - node->upLeft.first + 1) * canvas.scale * canvas.channels;
+
+    unsigned char* first = canvas.pixels + startY * canvas.stride + startX;
+    for (size_t i = 0; i < spanBytes; i += canvas.channels) {
+        copy(colour, colour + canvas.channels, first + i);
+    }
+    for (unsigned int y = startY + 1; y < endY; y++) {
+        copy(first, first + spanBytes, canvas.pixels + y * canvas.stride + startX);
+    }
 }
 
-Node* QTree::copyHelper(Node* otherNode) {
-    if (!otherNode) {
-        return nullptr; 
+/**
+ * Checks whether every node under node that a render with the given
+ * maxDepth and tolerance paints, as renderNode picks them, has alpha 1.
+ * Interior averages are not always opaque (exactAverages gives a node
+ * over translucent pixels a translucent average), so a render that paints
+ * interior nodes has to look at those nodes, not at the leaves below them.
+ */
+bool QTree::paintsOpaque(Node* node, unsigned int depth, unsigned int maxDepth, double tolerance) const {
+    if (!node) {
+        return true;
     }
 
-    // new node with the same data as otherNode
-    Node* newNode = new Node(otherNode->upLeft, otherNode->lowRight, otherNode->avg);
+    if (depth < maxDepth && isStub(node)) {
+        expandStub(node);
+    }
 
-    // copy child nodes
-    newNode->NW = copyHelper(otherNode->NW);
-    newNode->NE = copyHelper(otherNode->NE);
-    newNode->SW = copyHelper(otherNode->SW);
-    newNode->SE = copyHelper(otherNode->SE);
+    if (depth >= maxDepth || (!node->NW && !node->NE && !node->SW && !node->SE) ||
+        (tolerance >= 0 && pruneThreshold(node) <= tolerance)) {
+        return node->avg.a == 1.0;
+    }
+    return paintsOpaque(node->NW, depth + 1, maxDepth, tolerance) && paintsOpaque(node->NE, depth + 1, maxDepth, tolerance) &&
+           paintsOpaque(node->SW, depth + 1, maxDepth, tolerance) && paintsOpaque(node->SE, depth + 1, maxDepth, tolerance);
+}
 
-    return newNode;
+/**
+ * Collects the distinct colours, as RGBA8, of the nodes under node that a
+ * render with the given maxDepth and tolerance paints, picked as in
+ * paintsOpaque, and stops once there are more than limit of them.
+ */
+void QTree::paintedColours(Node* node, unsigned int depth, unsigned int maxDepth, double tolerance, size_t limit,
+                           unordered_map<unsigned int, RGBAPixel>& colours) const {
+    if (!node || colours.size() > limit) {
+        return;
+    }
+
+    if (depth < maxDepth && isStub(node)) {
+        expandStub(node);
+    }
+
+    if (depth >= maxDepth || (!node->NW && !node->NE && !node->SW && !node->SE) ||
+        (tolerance >= 0 && pruneThreshold(node) <= tolerance)) {
+        const RGBAPixel& avg = node->avg;
+        unsigned int alpha = static_cast<unsigned char>(avg.a * 255);
+        colours.insert(make_pair(avg.r | (avg.g << 8) | (avg.b << 16) | (alpha << 24), avg));
+        return;
+    }
+    paintedColours(node->NW, depth + 1, maxDepth, tolerance, limit, colours);
+    paintedColours(node->NE, depth + 1, maxDepth, tolerance, limit, colours);
+    paintedColours(node->SW, depth + 1, maxDepth, tolerance, limit, colours);
+    paintedColours(node->SE, depth + 1, maxDepth, tolerance, limit, colours);
 }
 
+/**
+ * Renders the tree as if every node at depth maxDepth were a leaf, painting
+ * its average over its whole rectangle; the tree below it is never visited.
+ * Otherwise the same as Render.
+ *
+ * @param maxDepth depth of the deepest nodes drawn; the root is at depth 0
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing the image, including the caller, as for Render
+ * @pre scale > 0
+ */
+PNG QTree::RenderLOD(unsigned int maxDepth, unsigned int scale, unsigned int threads) const {
+    if (!root) {
+        return PNG();
+    }
 
-void QTree::pruneHelper(Node* node, double tolerance) {
-    if (!node) return; 
+    PNG img((root->lowRight.first - root->upLeft.first + 1) * scale,
+            (root->lowRight.second - root->upLeft.second + 1) * scale);
+    renderCanvas(img, 0, 0, scale, threads, maxDepth);
+    return img;
+}
 
-    if (isLeaf(node)) return;
-
-    // check if leaf descendants are within the tolerance
-    if (allLeavesWithinTolerance(node, node->avg, tolerance)) {
-        // prune subtree
-        clearHelper(node->NW);
-        clearHelper(node->NE);
-        clearHelper(node->SW);
-        clearHelper(node->SE);
-        // set children to nullptr after pruning
-        node->NW = nullptr;
-        node->NE = nullptr;
-        node->SW = nullptr;
-        node->SE = nullptr;
-    } else {
-        //  prune child subtrees
-        pruneHelper(node->NW, tolerance);
-        pruneHelper(node->NE, tolerance);
-        pruneHelper(node->SW, tolerance);
-        pruneHelper(node->SE, tolerance);
+/**
+ * Renders the tree as Render does, but as if PruneTo(tolerance) had been
+ * called first: every node that would collapse is drawn as a leaf, and the
+ * tree below it is never visited, so the cost depends on the leaves of
+ * the result. The tree itself is not changed.
+ *
+ * @param tolerance maximum RGBA distance to qualify for pruning
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing the image, including the caller, as for Render
+ * @pre scale > 0
+ */
+PNG QTree::RenderPruned(double tolerance, unsigned int scale, unsigned int threads) const {
+    if (!root) {
+        return PNG();
     }
+
+    indexThresholds();
+    PNG img((root->lowRight.first - root->upLeft.first + 1) * scale,
+            (root->lowRight.second - root->upLeft.second + 1) * scale);
+    renderCanvas(img, 0, 0, scale, threads, ~0u, max(tolerance, 0.0));
+    return img;
 }
 
-bool QTree::allLeavesWithinTolerance(Node* node, const RGBAPixel& avg, double tolerance) {
-    if (isLeaf(node)) {
-        return node->avg.distanceTo(avg) <= tolerance;
+/**
+ * Renders the tree shrunk by an integer factor, straight from the node
+ * averages. Output pixel (X, Y) samples the render at the centre of the
+ * divisor x divisor block it stands for (clamped to the image), and gets
+ * the colour of the shallowest node containing that sample that covers
+ * no other sample, or of the leaf containing it. Nodes are not visited
+ * below that, so the cost is proportional to the output size.
+ *
+ * @param divisor factor the width and height are divided by, rounding up
+ * @pre divisor > 0
+ */
+PNG QTree::RenderDownscaled(unsigned int divisor) const {
+    if (!root) {
+        return PNG();
     }
 
-    //  check all children
-    return (!node->NW || allLeavesWithinTolerance(node->NW, avg, tolerance)) &&
-           (!node->NE || allLeavesWithinTolerance(node->NE, avg, tolerance)) &&
-           (!node->SW || allLeavesWithinTolerance(node->SW, avg, tolerance)) &&
-           (!node->SE || allLeavesWithinTolerance(node->SE, avg, tolerance));
+    unsigned int renderWidth = root->lowRight.first - root->upLeft.first + 1;
+    unsigned int renderHeight = root->lowRight.second - root->upLeft.second + 1;
+    vector<unsigned int> columns = downscaleSamples(renderWidth, divisor);
+    vector<unsigned int> rows = downscaleSamples(renderHeight, divisor);
+    PNG img(columns.size(), rows.size());
+    sampleInto(img, columns, rows, 0, 0);
+    return img;
 }
 
-bool QTree::isLeaf(Node* node) {
-    return node && !node->NW && !node->NE && !node->SW && !node->SE;
+/**
+ * Renders the tree at any output size. The output is scaled independently
+ * along each axis, and output pixel (X, Y) shows the render at the point
+ * under its centre: column floor((X + 1/2) * width / outWidth), and likewise
+ * for rows, computed exactly in integers. Each pixel gets the colour of the
+ * leaf at that point or, where the output is smaller than the render, of
+ * the shallowest node there that covers no other output pixel, so the
+ * detail drawn follows the output density and the tree is not visited
+ * below it. Render(scale) is RenderSize(width * scale, height * scale), and
+ * where the sizes divide evenly, RenderDownscaled(d) is RenderSize(width / d,
+ * height / d).
+ *
+ * @param outWidth width of the output, in pixels
+ * @param outHeight height of the output, in pixels
+ * @param threads threads drawing the image, including the caller, as for Render
+ */
+PNG QTree::RenderSize(unsigned int outWidth, unsigned int outHeight, unsigned int threads) const {
+    if (!root || outWidth == 0 || outHeight == 0) {
+        return PNG();
+    }
+
+    unsigned long long renderWidth = root->lowRight.first - root->upLeft.first + 1;
+    unsigned long long renderHeight = root->lowRight.second - root->upLeft.second + 1;
+    PNG img(outWidth, outHeight);
+
+    vector<unsigned int> columns(outWidth);
+    vector<unsigned int> rows(outHeight);
+    for (unsigned int x = 0; x < outWidth; x++) {
+        columns[x] = static_cast<unsigned int>((2ULL * x + 1) * renderWidth / (2ULL * outWidth));
+    }
+    for (unsigned int y = 0; y < outHeight; y++) {
+        rows[y] = static_cast<unsigned int>((2ULL * y + 1) * renderHeight / (2ULL * outHeight));
+    }
+
+    Sampler sampler;
+    sampler.pixels = img.getPixel(0, 0);
+    sampler.width = outWidth;
+    sampler.columns = &columns;
+    sampler.rows = &rows;
+    sampler.left = 0;
+    sampler.top = 0;
+    sampler.right = outWidth;
+    sampler.bottom = outHeight;
+
+    // bands of output rows; each band's sampler starts at its first row
+    forEachBand(outHeight, threads, [this, &sampler, outWidth](unsigned int top, unsigned int bottom) {
+        Sampler band = sampler;
+        band.top = top;
+        band.bottom = bottom;
+        band.pixels = sampler.pixels + static_cast<size_t>(top) * outWidth;
+        sampleNode(band, root);
+    });
+
+    return img;
 }
 
+/**
+ * Returns the samples RenderDownscaled(divisor) takes along an axis of the
+ * given size: the centre of each divisor-wide block, clamped to the axis.
+ */
+vector<unsigned int> QTree::downscaleSamples(unsigned int size, unsigned int divisor) {
+    vector<unsigned int> samples((size + divisor - 1) / divisor);
+    for (unsigned int i = 0; i < samples.size(); i++) {
+        samples[i] = min(i * divisor + divisor / 2, size - 1);
+    }
+    return samples;
+}
 
+/**
+ * Fills target with the block whose top left pixel is (left, top) of the
+ * image sampled at the given columns and rows. Those are the samples of
+ * the whole image, so nodes are judged as they are when it is drawn at
+ * once. target must lie within that image.
+ */
+void QTree::sampleInto(PNG& target, const vector<unsigned int>& columns, const vector<unsigned int>& rows,
+                       unsigned int left, unsigned int top) const {
+    if (!root || target.width() == 0 || target.height() == 0) {
+        return;
+    }
+
+    Sampler sampler;
+    sampler.pixels = target.getPixel(0, 0);
+    sampler.width = target.width();
+    sampler.columns = &columns;
+    sampler.rows = &rows;
+    sampler.left = left;
+    sampler.top = top;
+    sampler.right = left + target.width();
+    sampler.bottom = top + target.height();
+
+    sampleNode(sampler, root);
+}
+
+/**
+ * Writes the tree as a Deep Zoom image: the descriptor name.dzi, and
+ * the tile pyramid beside it, where tile (column, row) of level L is
+ * name_files/L/column_row.png, each tileSize x tileSize except along
+ * the right and bottom edges. Level 0 is the image shrunk to a single
+ * pixel, each level doubles the size of the one before, the level at
+ * scale 1 is Render(1), and the levels after it are Render(2), Render(4),
+ * ... up to maxScale. The descriptor gives the size of the last level.
+ *
+ * Each tile is drawn on its own: levels below scale 1 are sampled from
+ * the node averages as in RenderDownscaled, with the samples of a level
+ * worked out once and shared by its tiles, and the others are rendered
+ * as in RenderRegion, so no image larger than a tile is ever allocated.
+ * A tile's walk from the root only leaves the path to the tile at
+ * nodes outside it, so it costs about the tile's share of the level.
+ * Tiles are drawn and encoded as tasks spread over the given threads.
+ *
+ * @param name path of the descriptor, without ".dzi"; its directory must exist
+ * @param tileSize width and height of a tile
+ * @param maxScale largest upscale written; levels stop at the largest power of two not above it
+ * @param threads threads drawing and encoding tiles, including the caller
+ * @pre tileSize > 0, maxScale > 0
+ * @return false if the descriptor, a directory or a tile could not be written
+ */
+bool QTree::ExportTiles(const string& name, unsigned int tileSize, unsigned int maxScale,
+                        unsigned int threads) const {
+    if (!root) {
+        return false;
+    }
+
+    unsigned int renderWidth = root->lowRight.first - root->upLeft.first + 1;
+    unsigned int renderHeight = root->lowRight.second - root->upLeft.second + 1;
+
+    // halvings needed to bring the larger side down to one pixel
+    unsigned int shrinkLevels = 0;
+    while ((max(renderWidth, renderHeight) - 1) >> shrinkLevels) {
+        shrinkLevels++;
+    }
+
+    // the last level is at the largest power of two not above maxScale
+    unsigned long long topScale = 1;
+    while (topScale * 2 <= maxScale) {
+        topScale *= 2;
+    }
+
+    ofstream descriptor(name + ".dzi");
+    descriptor << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+               << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"png\" Overlap=\"0\" TileSize=\""
+               << tileSize << "\">\n"
+               << "  <Size Width=\"" << renderWidth * topScale << "\" Height=\"" << renderHeight * topScale << "\"/>\n"
+               << "</Image>\n";
+    descriptor.close();
+    if (!descriptor) {
+        return false;
+    }
+
+    string directory = name + "_files";
+    if (!makeDirectory(directory)) {
+        return false;
+    }
+
+    // a lazy tree builds stubs as it renders, which only one thread may do
+    WorkPool serial(1);
+    WorkPool& workers = stubs.empty() ? pool(threads) : serial;
+    atomic<bool> ok(true);
+
+    unsigned int level = 0;
+    for (unsigned long long scale = 1; scale <= maxScale; level++) {
+        // levels before shrinkLevels are downscaled by 2^(shrinkLevels - level)
+        unsigned int divisor = level < shrinkLevels ? 1u << (shrinkLevels - level) : 1;
+        unsigned long long levelWidth = level < shrinkLevels ? (renderWidth + divisor - 1) / divisor : renderWidth * scale;
+        unsigned long long levelHeight = level < shrinkLevels ? (renderHeight + divisor - 1) / divisor : renderHeight * scale;
+
+        string levelDirectory = directory + "/" + to_string(level);
+        if (!makeDirectory(levelDirectory)) {
+            return false;
+        }
+
+        // samples of the whole downscaled level, shared by its tiles
+        vector<unsigned int> columns, rows;
+        if (divisor > 1) {
+            columns = downscaleSamples(renderWidth, divisor);
+            rows = downscaleSamples(renderHeight, divisor);
+        }
+
+        WorkPool::TaskGroup group;
+        for (unsigned long long top = 0; top < levelHeight; top += tileSize) {
+            for (unsigned long long left = 0; left < levelWidth; left += tileSize) {
+                workers.Spawn(group, [=, &columns, &rows, &ok] {
+                    PNG tile(min<unsigned long long>(tileSize, levelWidth - left),
+                             min<unsigned long long>(tileSize, levelHeight - top));
+                    if (divisor > 1) {
+                        sampleInto(tile, columns, rows, left, top);
+                    } else {
+                        renderCanvas(tile, -static_cast<long long>(left), -static_cast<long long>(top),
+                                     scale, 1);
+                    }
+
+                    string file = levelDirectory + "/" + to_string(left / tileSize) + "_" +
+                                  to_string(top / tileSize) + ".png";
+                    if (!tile.writeToFile(file)) {
+                        ok = false;
+                    }
+                });
+            }
+        }
+        workers.Wait(group);
+
+        if (level >= shrinkLevels) {
+            scale *= 2;
+        }
+    }
+
+    return ok;
+}
+
+/**
+ * Saves Render(scale) as a PNG file without building it: the image is
+ * rendered a band of rows at a time, and each band is encoded and written
+ * before the next is drawn. Only one band (about 4MB of pixels) and two
+ * rows of bytes are held at a time, however large the image. As lodepng
+ * would, the file uses a palette if the leaves have at most 256 colours;
+ * otherwise it is RGB if every leaf is opaque, and RGBA if not.
+ *
+ * @param fileName the file to write
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param threads threads drawing each band, including the caller, as for Render
+ * @pre scale > 0
+ * @return false if the tree is empty or the file could not be written
+ */
+bool QTree::RenderToFile(const string& fileName, unsigned int scale, unsigned int threads) const {
+    return writeRender(fileName, scale, threads, -1);
+}
+
+/**
+ * RenderToFile, drawing the nodes Prune(tolerance) would collapse as
+ * leaves if tolerance >= 0.
+ */
+bool QTree::writeRender(const string& fileName, unsigned int scale, unsigned int threads, double tolerance) const {
+    const size_t bandBytes = 1 << 22;
+
+    if (!root) {
+        return false;
+    }
+
+    unsigned int imageWidth = (root->lowRight.first - root->upLeft.first + 1) * scale;
+    unsigned int imageHeight = (root->lowRight.second - root->upLeft.second + 1) * scale;
+
+    // stored with a palette when the render paints at most 256 colours, as
+    // lodepng would, and otherwise as RGB when every node it paints is opaque
+    unordered_map<unsigned int, RGBAPixel> colours;
+    paintedColours(root, 0, ~0u, tolerance, 256, colours);
+    vector<RGBAPixel> palette;
+    if (colours.size() <= 256) {
+        for (auto it = colours.begin(); it != colours.end(); ++it) {
+            palette.push_back(it->second);
+        }
+    }
+
+    PNGStream out;
+    if (!out.Open(fileName, imageWidth, imageHeight, !paintsOpaque(root, 0, ~0u, tolerance), palette)) {
+        return false;
+    }
+
+    unsigned int bandRows = max<size_t>(1, bandBytes / (static_cast<size_t>(imageWidth) * sizeof(RGBAPixel)));
+    PNG band(imageWidth, min(bandRows, imageHeight));
+    for (unsigned int top = 0; top < imageHeight; top += band.height()) {
+        renderCanvas(band, 0, -static_cast<long long>(top), scale, threads, ~0u, tolerance);
+
+        unsigned int rows = min(band.height(), imageHeight - top);
+        for (unsigned int y = 0; y < rows; y++) {
+            out.WriteRow(band.getPixel(0, y));
+        }
+    }
+
+    return out.Close();
+}
+
+/**
+ * Creates the directory at path unless it already exists.
+ * @return false if it neither exists nor could be created
+ */
+bool QTree::makeDirectory(const string& path) {
+    if (mkdir(path.c_str(), 0777) == 0 || errno == EEXIST) {
+        return true;
+    }
+    cerr << "cannot create directory " << path << endl;
+    return false;
+}
+
+/**
+ * Paints the output pixels whose samples fall in node's rectangle. The
+ * samples of each axis are sorted, so those pixels form a block found by
+ * binary search. A node covering a single output pixel, or a leaf, paints
+ * its block with its average; otherwise its children paint theirs.
+ */
+void QTree::sampleNode(const Sampler& sampler, Node* node) const {
+    if (!node) {
+        return;
+    }
+
+    const vector<unsigned int>& columns = *sampler.columns;
+    const vector<unsigned int>& rows = *sampler.rows;
+    unsigned int left = lower_bound(columns.begin(), columns.end(), node->upLeft.first) - columns.begin();
+    unsigned int right = upper_bound(columns.begin(), columns.end(), node->lowRight.first) - columns.begin();
+    unsigned int top = lower_bound(rows.begin(), rows.end(), node->upLeft.second) - rows.begin();
+    unsigned int bottom = upper_bound(rows.begin(), rows.end(), node->lowRight.second) - rows.begin();
+    if (left >= right || top >= bottom) {
+        return;
+    }
+
+    bool single = right - left == 1 && bottom - top == 1;
+
+    // only the part inside the window is drawn
+    left = max(left, sampler.left);
+    right = min(right, sampler.right);
+    top = max(top, sampler.top);
+    bottom = min(bottom, sampler.bottom);
+    if (left >= right || top >= bottom) {
+        return;
+    }
+
+    if (!single && isStub(node)) {
+        expandStub(node);
+    }
+
+    if (single || (!node->NW && !node->NE && !node->SW && !node->SE)) {
+        for (unsigned int y = top; y < bottom; y++) {
+            RGBAPixel* row = sampler.pixels + static_cast<size_t>(y - sampler.top) * sampler.width;
+            fill(row + (left - sampler.left), row + (right - sampler.left), node->avg);
+        }
+        return;
+    }
+
+    sampleNode(sampler, node->NW);
+    sampleNode(sampler, node->NE);
+    sampleNode(sampler, node->SW);
+    sampleNode(sampler, node->SE);
+}
+
+
+
+
+
+void QTree::clearHelper(Node* node, unsigned int depth) {
+    if (!node) {
+        return; 
+    }
+
+    stats.nodes--;
+    stats.depths[depth]--;
+    if (isLeaf(node)) {
+        stats.leaves--;
+    }
+
+    // recursively clear child nodes
+    clearHelper(node->NW, depth + 1);
+    clearHelper(node->NE, depth + 1);
+    clearHelper(node->SW, depth + 1);
+    clearHelper(node->SE, depth + 1);
+
+    if (!stubs.empty()) {
+        stubs.erase(node);
+    }
+    if (!thresholds.empty()) {
+        thresholds.erase(node);
+    }
+    nodePool.Release(node);
+}
+
+Node* QTree::copyHelper(Node* otherNode, const unordered_map<const Node*, unsigned int>& otherStubs,
+                        const unordered_map<const Node*, double>& otherThresholds) {
+    if (!otherNode) {
+        return nullptr; 
+    }
+
+    // new node with the same data as otherNode
+    Node* newNode = nodePool.Make(otherNode->upLeft, otherNode->lowRight, otherNode->avg);
+    if (nodePool.KeepsSums()) {
+        NodePool::SumsOf(newNode) = NodePool::SumsOf(otherNode);
+    }
+    if (!otherStubs.empty()) {
+        unordered_map<const Node*, unsigned int>::const_iterator stub = otherStubs.find(otherNode);
+        if (stub != otherStubs.end()) {
+            stubs[newNode] = stub->second;
+        }
+    }
+    if (!otherThresholds.empty()) {
+        unordered_map<const Node*, double>::const_iterator threshold = otherThresholds.find(otherNode);
+        if (threshold != otherThresholds.end()) {
+            thresholds[newNode] = threshold->second;
+        }
+    }
+
+    // copy child nodes
+    newNode->NW = copyHelper(otherNode->NW, otherStubs, otherThresholds);
+    newNode->NE = copyHelper(otherNode->NE, otherStubs, otherThresholds);
+    newNode->SW = copyHelper(otherNode->SW, otherStubs, otherThresholds);
+    newNode->SE = copyHelper(otherNode->SE, otherStubs, otherThresholds);
+
+    return newNode;
+}
+
+
+/**
+ * Prunes the subtree at node. pruneBounds decides, bottom-up and with the
+ * tree untouched, which nodes Prune collapses, and only then are those
+ * changes made; the decisions are the ones the top-down definition of
+ * Prune makes.
+ */
+void QTree::pruneHelper(Node* node, double tolerance, unsigned int depth) {
+    if (!node) return; 
+
+    RegionBounds bounds;
+    vector<PruneStep> steps;
+    bool within = pruneBounds(node, tolerance, depth, bounds, steps);
+    if (within || isStub(node)) {
+        steps.push_back({ node, depth, within });
+    }
+
+    for (size_t i = 0; i < steps.size(); i++) {
+        settlePrune(steps[i], tolerance);
+    }
+}
+
+/**
+ * Gathers into bounds the channel ranges of the leaves under node, with a
+ * leaf holding each extreme, from those of its children, and returns
+ * whether every one of those leaves is within tolerance of node's average.
+ * The bounds usually settle that in O(1); only when they cannot are the
+ * leaves walked, which is why nothing may change until the pass is over.
+ *
+ * So the pass is not linear. Each node the bounds leave open costs a walk
+ * of its subtree, which is O(n log n) over the tree if no node is settled
+ * by its bounds. A stub's pixels are scanned for its bounds, and again by
+ * every walk that reaches it.
+ *
+ * If node is kept, its children's fates are final, and the ones that
+ * change are appended to steps; if it collapses, the steps appended for
+ * its subtree, which are the last ones in steps, are dropped again.
+ */
+bool QTree::pruneBounds(Node* node, double tolerance, unsigned int depth, RegionBounds& bounds,
+                        vector<PruneStep>& steps) {
+    if (isStub(node)) {
+        // the leaves below a stub are the pixels of its region
+        bounds.Reset(source.At(node->upLeft.first, node->upLeft.second));
+        for (unsigned int y = node->upLeft.second; y <= node->lowRight.second; y++) {
+            for (unsigned int x = node->upLeft.first; x <= node->lowRight.first; x++) {
+                bounds.Add(source.At(x, y));
+            }
+        }
+        return regionWithinTolerance(source, node->upLeft, node->lowRight, bounds, node->avg, tolerance);
+    }
+
+    if (isLeaf(node)) {
+        bounds.Reset(node->avg);
+        return true;
+    }
+
+    size_t mark = steps.size();
+    Node* children[4] = { node->NW, node->NE, node->SW, node->SE };
+    bool within[4] = { true, true, true, true };
+    bool leaf[4] = { false, false, false, false };  // plain leaves, which never change
+    bool first = true;
+    RegionBounds childBounds;
+    for (int i = 0; i < 4; i++) {
+        Node* child = children[i];
+        if (!child) continue;
+
+        leaf[i] = isLeaf(child) && !isStub(child);
+        if (leaf[i]) {
+            // most nodes are leaves: add them in place
+            if (first) {
+                bounds.Reset(child->avg);
+            } else {
+                bounds.Add(child->avg);
+            }
+        } else {
+            within[i] = pruneBounds(child, tolerance, depth + 1, first ? bounds : childBounds, steps);
+            if (!first) {
+                bounds.Merge(childBounds);
+            }
+        }
+        first = false;
+    }
+
+    bool result;
+    if (!bounds.Decides(node->avg, tolerance, result)) {
+        result = allLeavesWithinTolerance(node, node->avg, tolerance);
+    }
+
+    if (result) {
+        if (steps.size() > mark) {
+            steps.resize(mark);
+        }
+    } else {
+        for (int i = 0; i < 4; i++) {
+            Node* child = children[i];
+            if (child && !leaf[i] && (within[i] || isStub(child))) {
+                steps.push_back({ child, depth + 1, within[i] });
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Makes one change pruneBounds decided on: collapses the node into a
+ * leaf, or, for a stub that is kept, builds it one step further and
+ * prunes it again.
+ */
+void QTree::settlePrune(const PruneStep& step, double tolerance) {
+    Node* node = step.node;
+    bool stub = isStub(node);
+
+    if (!step.collapse) {
+        expandStub(node);
+        pruneHelper(node, tolerance, step.depth);
+        return;
+    }
+
+    if (!stub && isLeaf(node)) return;
+
+    markDirty(node);
+    // as a leaf it now collapses at any tolerance
+    if (!thresholds.empty()) {
+        thresholds.erase(node);
+    }
+    if (stub) {
+        // its leaves were never built; it simply stays a leaf
+        stubs.erase(node);
+        return;
+    }
+    // prune subtree
+    clearHelper(node->NW, step.depth + 1);
+    clearHelper(node->NE, step.depth + 1);
+    clearHelper(node->SW, step.depth + 1);
+    clearHelper(node->SE, step.depth + 1);
+    stats.leaves++;
+    // set children to nullptr after pruning
+    node->NW = nullptr;
+    node->NE = nullptr;
+    node->SW = nullptr;
+    node->SE = nullptr;
+}
+
+/**
+ * Prune with the distance policy whose kernels are given, as pruneHelper
+ * does it: colorBounds decides every interior node in one post-order
+ * pass, and only then are the collapses it found made.
+ */
+void QTree::pruneWith(double tolerance, const DistanceKernels& kernels) {
+    if (!root) return;
+    materializeHelper(root);
+    if (isLeaf(root)) return;
+
+    ColorBounds bounds;
+    vector<PruneStep> steps;
+    vector<RGBAPixel> leaves;
+    vector<DistanceColor> colors;
+    if (colorBounds(root, 0, tolerance, kernels, bounds, steps, leaves, colors)) {
+        steps.push_back({ root, 0, true });
+    }
+
+    for (size_t i = 0; i < steps.size(); i++) {
+        settlePrune(steps[i], tolerance);
+    }
+}
+
+/**
+ * pruneBounds for a distance policy, on a tree with no stubs: gathers into
+ * bounds the range of each channel of the prepared colours of the leaves
+ * under node, an interior node, with a leaf colour holding each extreme,
+ * and returns whether every one of those leaves is within tolerance of
+ * node's average under the policy. The bounds usually settle that in
+ * O(1); only when they cannot are the leaves listed into leaves, prepared
+ * into colors, and tested with one batched kernels.within call.
+ *
+ * If node is kept, the children that collapse are appended to steps; if
+ * it collapses, the steps appended for its subtree are dropped again.
+ */
+bool QTree::colorBounds(Node* node, unsigned int depth, double tolerance, const DistanceKernels& kernels,
+                        ColorBounds& bounds, vector<PruneStep>& steps, vector<RGBAPixel>& leaves,
+                        vector<DistanceColor>& colors) {
+    size_t mark = steps.size();
+    Node* children[4] = { node->NW, node->NE, node->SW, node->SE };
+    bool within[4] = { true, true, true, true };
+    bool leaf[4] = { false, false, false, false };
+    bool first = true;
+    ColorBounds childBounds;
+    for (int i = 0; i < 4; i++) {
+        Node* child = children[i];
+        if (!child) continue;
+
+        leaf[i] = isLeaf(child);
+        if (leaf[i]) {
+            // most nodes are leaves: add them in place
+            DistanceColor color;
+            kernels.prepare(&child->avg, 1, &color);
+            if (first) {
+                bounds.Reset(color);
+            } else {
+                bounds.Add(color);
+            }
+        } else {
+            within[i] = colorBounds(child, depth + 1, tolerance, kernels, first ? bounds : childBounds, steps,
+                                    leaves, colors);
+            if (!first) {
+                bounds.Merge(childBounds);
+            }
+        }
+        first = false;
+    }
+
+    DistanceColor avg;
+    kernels.prepare(&node->avg, 1, &avg);
+    bool result;
+    if (!kernels.decide(bounds, avg, tolerance, result)) {
+        leaves.clear();
+        listLeaves(node, leaves);
+        colors.resize(leaves.size());
+        kernels.prepare(leaves.data(), leaves.size(), colors.data());
+        result = kernels.within(colors.data(), colors.size(), avg, tolerance);
+    }
+
+    if (result) {
+        if (steps.size() > mark) {
+            steps.resize(mark);
+        }
+    } else {
+        for (int i = 0; i < 4; i++) {
+            if (children[i] && !leaf[i] && within[i]) {
+                steps.push_back({ children[i], depth + 1, true });
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * Appends the leaf colours of the subtree at node to leaves, in preorder.
+ */
+void QTree::listLeaves(Node* node, vector<RGBAPixel>& leaves) const {
+    if (!node) return;
+
+    if (isLeaf(node)) {
+        leaves.push_back(node->avg);
+        return;
+    }
+
+    listLeaves(node->NW, leaves);
+    listLeaves(node->NE, leaves);
+    listLeaves(node->SW, leaves);
+    listLeaves(node->SE, leaves);
+}
+
+/**
+ * Collapses the nodes of the subtree at node that PruneTo(tolerance)
+ * removes, stopping at the first such node on each path.
+ */
+void QTree::pruneToHelper(Node* node, double tolerance, unsigned int depth) {
+    if (!node || isLeaf(node)) return;
+
+    if (pruneThreshold(node) <= tolerance) {
+        settlePrune({ node, depth, true }, tolerance);
+        return;
+    }
+
+    pruneToHelper(node->NW, tolerance, depth + 1);
+    pruneToHelper(node->NE, tolerance, depth + 1);
+    pruneToHelper(node->SW, tolerance, depth + 1);
+    pruneToHelper(node->SE, tolerance, depth + 1);
+}
+
+/**
+ * Collapses nodes, cheapest first, until the tree has at most maxLeaves
+ * leaves and maxNodes nodes, or is a single leaf. A node collapsed or
+ * removed by an earlier collapse has also left thresholds, which is how
+ * it is skipped.
+ * Returns the largest threshold collapsed.
+ */
+double QTree::pruneToBudget(unsigned long maxLeaves, unsigned long maxNodes) {
+    indexThresholds();
+
+    vector<MergeCandidate> candidates;
+    collectCandidates(root, 0, candidates);
+    priority_queue<MergeCandidate> queue(less<MergeCandidate>(), std::move(candidates));
+
+    double error = 0;
+    while ((stats.leaves > maxLeaves || stats.nodes > maxNodes) && !queue.empty()) {
+        MergeCandidate next = queue.top();
+        queue.pop();
+        if (thresholds.count(next.node) == 0 || isLeaf(next.node)) {
+            continue;
+        }
+
+        settlePrune({ next.node, next.depth, true }, next.threshold);
+        error = next.threshold;
+    }
+    return error;
+}
+
+/**
+ * Appends every interior node of the subtree at node to candidates.
+ */
+void QTree::collectCandidates(Node* node, unsigned int depth, vector<MergeCandidate>& candidates) const {
+    if (!node || isLeaf(node)) {
+        return;
+    }
+
+    candidates.push_back({ pruneThreshold(node), depth, node });
+    collectCandidates(node->NW, depth + 1, candidates);
+    collectCandidates(node->NE, depth + 1, candidates);
+    collectCandidates(node->SW, depth + 1, candidates);
+    collectCandidates(node->SE, depth + 1, candidates);
+}
+
+/**
+ * The smallest tolerance at which View has at most maxLeaves leaves, or
+ * the root's threshold if none has. A node is a leaf of View(t) for t in
+ * [its threshold, the smallest threshold above it), so the leaf count at
+ * any t is a sum over those intervals' ends, swept in order.
+ */
+double QTree::toleranceForLeaves(unsigned long maxLeaves) const {
+    if (!root) {
+        return 0;
+    }
+
+    vector<pair<double, int> > events;
+    leafIntervals(root, numeric_limits<double>::infinity(), events);
+    sort(events.begin(), events.end());
+
+    long leaves = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        leaves += events[i].second;
+        bool last = (i + 1 == events.size() || events[i + 1].first != events[i].first);
+        if (last && leaves <= static_cast<long>(max(maxLeaves, 1ul))) {
+            return events[i].first;
+        }
+    }
+    return pruneThreshold(root);
+}
+
+/**
+ * Appends the interval of tolerances at which each node of the subtree
+ * at node is a leaf of View, as +1 at its start and -1 at its end. above
+ * is the smallest threshold among node's ancestors. A leaf's interval
+ * starts at 0, whatever the index holds for it.
+ */
+void QTree::leafIntervals(Node* node, double above, vector<pair<double, int> >& events) const {
+    if (!node) {
+        return;
+    }
+
+    double threshold = isLeaf(node) ? 0 : pruneThreshold(node);
+    if (threshold < above) {
+        events.push_back(make_pair(threshold, 1));
+        if (above != numeric_limits<double>::infinity()) {
+            events.push_back(make_pair(above, -1));
+        }
+    }
+
+    if (!isLeaf(node)) {
+        above = min(above, threshold);
+        leafIntervals(node->NW, above, events);
+        leafIntervals(node->NE, above, events);
+        leafIntervals(node->SW, above, events);
+        leafIntervals(node->SE, above, events);
+    }
+}
+
+/**
+ * Adds the nodes and leaves of the subtree at node, as View(tolerance)
+ * sees it, to the counts.
+ */
+void QTree::countView(Node* node, double tolerance, unsigned long& nodes, unsigned long& leaves) const {
+    if (!node) {
+        return;
+    }
+
+    nodes++;
+    if (isLeaf(node) || pruneThreshold(node) <= tolerance) {
+        leaves++;
+        return;
+    }
+
+    countView(node->NW, tolerance, nodes, leaves);
+    countView(node->NE, tolerance, nodes, leaves);
+    countView(node->SW, tolerance, nodes, leaves);
+    countView(node->SE, tolerance, nodes, leaves);
+}
+
+/**
+ * Computes the prune threshold of every interior node, unless that has
+ * been done already. A lazy tree is built in full first, so that every
+ * threshold is exact.
+ */
+void QTree::indexThresholds() const {
+    if (!root || !thresholds.empty()) return;
+
+    materializeHelper(root);
+    if (isLeaf(root)) return;
+
+    thresholds.reserve(stats.nodes - stats.leaves);
+    RegionBounds bounds;
+    thresholdHelper(root, bounds);
+}
+
+/**
+ * Stores the prune threshold of every interior node under node, gathers
+ * into bounds the channel ranges of its leaves, and returns node's own
+ * threshold (0 for a leaf). The leaves holding the extreme channel values
+ * give a first value for the maximum, and a child whose bounds show that
+ * none of its leaves can exceed it is not walked.
+ */
+double QTree::thresholdHelper(Node* node, RegionBounds& bounds) const {
+    if (isLeaf(node)) {
+        bounds.Reset(node->avg);
+        return 0;
+    }
+
+    Node* children[4] = { node->NW, node->NE, node->SW, node->SE };
+    RegionBounds childBounds[4];
+    bool first = true;
+    for (int i = 0; i < 4; i++) {
+        if (children[i]) {
+            thresholdHelper(children[i], childBounds[i]);
+            if (first) {
+                bounds = childBounds[i];
+            } else {
+                bounds.Merge(childBounds[i]);
+            }
+            first = false;
+        }
+    }
+
+    double threshold = 0;
+    for (int c = 0; c < 4; c++) {
+        threshold = max(threshold, bounds.lowPixel[c].Pixel().distanceTo(node->avg));
+        threshold = max(threshold, bounds.highPixel[c].Pixel().distanceTo(node->avg));
+    }
+
+    for (int i = 0; i < 4; i++) {
+        // margin for rounding, as in RegionBounds::Decides
+        if (children[i] && childBounds[i].MaxDistanceTo(node->avg) + 1e-9 > threshold) {
+            threshold = maxLeafDistance(children[i], node->avg, threshold);
+        }
+    }
+
+    thresholds[node] = threshold;
+    return threshold;
+}
+
+/**
+ * Returns the larger of best and the largest distanceTo from a leaf under
+ * node to avg. The square root of distanceTo is a norm of the difference
+ * of the two premultiplied colours, so no leaf under node is further from
+ * avg than (sqrt(threshold) + sqrt(node->avg.distanceTo(avg)))^2, and a
+ * subtree whose threshold is already stored is skipped when that cannot
+ * beat best. A subtree without one is always walked.
+ */
+double QTree::maxLeafDistance(Node* node, const RGBAPixel& avg, double best) const {
+    double toAvg = node->avg.distanceTo(avg);
+    if (isLeaf(node)) {
+        return max(best, toAvg);
+    }
+
+    unordered_map<const Node*, double>::const_iterator known = thresholds.find(node);
+    if (known != thresholds.end()) {
+        double reach = sqrt(known->second) + sqrt(toAvg);
+        // margin for rounding, as in RegionBounds::Decides
+        if (reach * reach + 1e-9 <= best) {
+            return best;
+        }
+    }
+
+    if (node->NW) best = maxLeafDistance(node->NW, avg, best);
+    if (node->NE) best = maxLeafDistance(node->NE, avg, best);
+    if (node->SW) best = maxLeafDistance(node->SW, avg, best);
+    if (node->SE) best = maxLeafDistance(node->SE, avg, best);
+    return best;
+}
+
+/**
+ * The smallest tolerance at which Prune collapses node; 0 for a leaf.
+ */
+double QTree::pruneThreshold(const Node* node) const {
+    unordered_map<const Node*, double>::const_iterator threshold = thresholds.find(node);
+    return (threshold == thresholds.end()) ? 0 : threshold->second;
+}
+
+bool QTree::allLeavesWithinTolerance(Node* node, const RGBAPixel& avg, double tolerance) {
+    if (isStub(node)) {
+        // the leaves below a stub are the pixels of its region
+        return pixelsWithinTolerance(source, node->upLeft, node->lowRight, avg, tolerance);
+    }
+
+    if (isLeaf(node)) {
+        return node->avg.distanceTo(avg) <= tolerance;
+    }
+
+    //  check all children
+    return (!node->NW || allLeavesWithinTolerance(node->NW, avg, tolerance)) &&
+           (!node->NE || allLeavesWithinTolerance(node->NE, avg, tolerance)) &&
+           (!node->SW || allLeavesWithinTolerance(node->SW, avg, tolerance)) &&
+           (!node->SE || allLeavesWithinTolerance(node->SE, avg, tolerance));
+}
+
+bool QTree::isLeaf(Node* node) const {
+    return node && !node->NW && !node->NE && !node->SW && !node->SE;
+}
+
+QTree::PixelSource::PixelSource() : pixels(nullptr), bytes(nullptr), stride(0), width(0), height(0) {
+}
+
+QTree::PixelSource::PixelSource(const PNG& img)
+    : pixels(nullptr), bytes(nullptr), stride(img.width()), width(img.width()), height(img.height()) {
+    if (width > 0 && height > 0) {
+        pixels = img.getPixel(0, 0);
+    }
+}
+
+QTree::PixelSource::PixelSource(const unsigned char* rgba, unsigned int w, unsigned int h, size_t rowStride)
+    : pixels(nullptr), bytes(rgba), stride(rowStride), width(w), height(h) {
+}
+
+void QTree::RegionBounds::Reset(const RGBAPixel& pixel) {
+    low[0] = high[0] = pixel.r;
+    low[1] = high[1] = pixel.g;
+    low[2] = high[2] = pixel.b;
+    low[3] = high[3] = pixel.a;
+    Sample sample = { pixel.r, pixel.g, pixel.b, pixel.a };
+    for (int c = 0; c < 4; c++) {
+        lowPixel[c] = highPixel[c] = sample;
+    }
+}
+
+void QTree::RegionBounds::Add(const RGBAPixel& pixel) {
+    double channel[4] = { static_cast<double>(pixel.r), static_cast<double>(pixel.g),
+                          static_cast<double>(pixel.b), pixel.a };
+    for (int c = 0; c < 4; c++) {
+        if (channel[c] < low[c]) {
+            low[c] = channel[c];
+            lowPixel[c] = { pixel.r, pixel.g, pixel.b, pixel.a };
+        }
+        if (channel[c] > high[c]) {
+            high[c] = channel[c];
+            highPixel[c] = { pixel.r, pixel.g, pixel.b, pixel.a };
+        }
+    }
+}
+
+void QTree::RegionBounds::Merge(const RegionBounds& other) {
+    for (int c = 0; c < 4; c++) {
+        if (other.low[c] < low[c]) {
+            low[c] = other.low[c];
+            lowPixel[c] = other.lowPixel[c];
+        }
+        if (other.high[c] > high[c]) {
+            high[c] = other.high[c];
+            highPixel[c] = other.highPixel[c];
+        }
+    }
+}
+
+/**
+ * distanceTo takes, per colour channel, the larger of d * d and
+ * (d - da) * (d - da), where d is the difference of the premultiplied
+ * channel p = a * v / 255 and da that of alpha. Over the box of channel
+ * ranges, p and a - p each lie in an interval, so each square is at most
+ * its value at one end of that interval.
+ */
+double QTree::RegionBounds::MaxDistanceTo(const RGBAPixel& avg) const {
+    // multiplying by the reciprocal rounds differently from distanceTo's
+    // division, which the caller's margin allows for
+    const double scale = 1 / 255.0;
+    double avgChannel[3] = { avg.r * scale * avg.a, avg.g * scale * avg.a, avg.b * scale * avg.a };
+
+    double total = 0;
+    for (int c = 0; c < 3; c++) {
+        double lowP = low[c] * scale * low[3];
+        double highP = high[c] * scale * high[3];
+        double lowRest = low[3] * (1 - high[c] * scale);   // a - p
+        double highRest = high[3] * (1 - low[c] * scale);
+
+        double d1 = avgChannel[c] - highP;
+        double d2 = avgChannel[c] - lowP;
+        double e1 = avgChannel[c] - avg.a + lowRest;
+        double e2 = avgChannel[c] - avg.a + highRest;
+
+        total += max(max(d1 * d1, d2 * d2), max(e1 * e1, e2 * e2));
+    }
+    return total;
+}
+
+/**
+ * Shared body of the constructors: builds the tree for src as described
+ * for QTree(const PNG&, const BuildOptions&).
+ */
+void QTree::Build(const PixelSource& src, const BuildOptions& options) {
+    width = src.width;
+    height = src.height;
+    // the builders count each node as they make it
+    stats = TreeStats();
+
+    bool merge = options.mergeTolerance >= 0;
+
+    // exact averages are added up from each node's children. A lazy tree
+    // also needs the average of each stub's region before building it, so
+    // it keeps a table of running sums over the image, or otherwise the
+    // averages of every depth's grid
+    nodePool.KeepSums(options.exactAverages);
+    sums.reset();
+    averages.reset();
+    if (options.lazyDepth > 0 && width > 0 && height > 0) {
+        if (options.exactAverages) {
+            shared_ptr<SumTable> table = make_shared<SumTable>();
+            table->Fill(src);
+            sums = table;
+        } else {
+            shared_ptr<LevelAverages> table = make_shared<LevelAverages>();
+            table->Fill(src);
+            averages = table;
+        }
+    }
+
+    if (options.lazyDepth > 0) {
+        source = src;
+        lazyDepth = options.lazyDepth;
+        root = nullptr;
+        if (width > 0 && height > 0) {
+            root = BuildNodeLazy(src, make_pair(0, 0), make_pair(width - 1, height - 1), nodePool, lazyDepth, 0);
+        }
+        // Prune on a lazy tree scans the pixels of a stub instead of building it
+        if (merge) {
+            pruneHelper(root, options.mergeTolerance, 0);
+        }
+        return;
+    }
+
+    root = BuildEager(src, options);
+
+    // the pyramid needs every level of the tree, so it prunes afterwards
+    if (options.pyramid && merge) {
+        pruneHelper(root, options.mergeTolerance, 0);
+    }
+}
+
+/**
+ * Builds the whole tree for src at once, in the way options ask for,
+ * except that a pyramid build is left for Build to prune.
+ * @return the root of the tree
+ */
+Node* QTree::BuildEager(const PixelSource& src, const BuildOptions& options) {
+    bool merge = options.mergeTolerance >= 0;
+
+    if (options.pyramid) {
+        return BuildPyramid(src, nodePool, stats);
+    }
+
+    if (width == 0 || height == 0) {
+        return nullptr;
+    }
+
+    pair<unsigned int, unsigned int> ul = make_pair(0, 0);
+    pair<unsigned int, unsigned int> lr = make_pair(width - 1, height - 1);
+    MergedRegion region;
+    if (options.threads <= 1) {
+        if (merge) {
+            BuildNodeMerged(src, ul, lr, nodePool, options.mergeTolerance, 0, stats, region);
+            return mergedNode(region, ul, lr, nodePool, 0, stats);
+        }
+        return BuildNode(src, ul, lr, nodePool, 0, stats);
+    }
+
+    WorkPool& workers = pool(options.threads);
+    Node* node = BuildNodeParallel(src, ul, lr, workers, nodePool, options.cutoff, options.mergeTolerance,
+                                   0, stats, merge ? &region : nullptr);
+    return merge ? mergedNode(region, ul, lr, nodePool, 0, stats) : node;
+}
+
+/**
+ * Computes the NW, NE, SW, SE child rectangles of the rectangle (ul, lr),
+ * following the splitting rule described for the constructor.
+ * @param present receives false for children that do not exist
+ */
+void QTree::splitRect(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                      pair<unsigned int, unsigned int> childUL[4], pair<unsigned int, unsigned int> childLR[4],
+                      bool present[4]) const {
+    // dimensions of this rectangle (not the tree's width/height members)
+    unsigned int w = lr.first - ul.first + 1;
+    unsigned int h = lr.second - ul.second + 1;
+
+    unsigned int midX = ul.first + w / 2;
+    unsigned int midY = ul.second + h / 2;
+
+    if (w % 2 == 0) midX--;
+    if (h % 2 == 0) midY--;
+
+    childUL[0] = ul;
+    childLR[0] = make_pair(midX, midY);
+    childUL[1] = make_pair(midX + 1, ul.second);
+    childLR[1] = make_pair(lr.first, midY);
+    childUL[2] = make_pair(ul.first, midY + 1);
+    childLR[2] = make_pair(midX, lr.second);
+    childUL[3] = make_pair(midX + 1, midY + 1);
+    childLR[3] = lr;
+
+    present[0] = true;
+    present[1] = w > 1;
+    present[2] = h > 1;
+    present[3] = w > 1 && h > 1;
+}
+
+/**
+ * Builds the same subtree as BuildNode, spawning the NE, SW and SE quadrants
+ * of large regions as tasks on workers while this thread builds the NW one.
+ * Regions smaller than cutoff pixels are handed to BuildNode.
+ * Each task allocates from a pool of its own, and counts into stats of its
+ * own, which are added into nodes and counts once the task has finished,
+ * so nothing is shared between threads.
+ * If region is not null, builds the subtree of BuildNodeMerged instead,
+ * and fills in region as it does.
+ */
+Node* QTree::BuildNodeParallel(const PixelSource& src, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                               WorkPool& workers, NodePool& nodes, unsigned long cutoff,
+                               double tolerance, unsigned int depth, TreeStats& counts, MergedRegion* region) {
+    unsigned long area = static_cast<unsigned long>(lr.first - ul.first + 1) * (lr.second - ul.second + 1);
+    if (area < cutoff || ul == lr) {
+        if (region) {
+            BuildNodeMerged(src, ul, lr, nodes, tolerance, depth, counts, *region);
+            return region->node;
+        }
+        return BuildNode(src, ul, lr, nodes, depth, counts);
+    }
+
+    pair<unsigned int, unsigned int> childUL[4], childLR[4];
+    bool present[4];
+    splitRect(ul, lr, childUL, childLR, present);
+
+    Node* children[4] = { nullptr, nullptr, nullptr, nullptr };
+    NodePool taskNodes[4];
+    TreeStats taskCounts[4];
+    MergedRegion childRegions[4];
+
+    WorkPool::TaskGroup group;
+    for (int i = 1; i < 4; i++) {
+        if (present[i]) {
+            Node** slot = &children[i];
+            NodePool* slotNodes = &taskNodes[i];
+            TreeStats* slotCounts = &taskCounts[i];
+            MergedRegion* slotRegion = region ? &childRegions[i] : nullptr;
+            slotNodes->KeepSums(nodes.KeepsSums());
+            pair<unsigned int, unsigned int> cul = childUL[i];
+            pair<unsigned int, unsigned int> clr = childLR[i];
+            workers.Spawn(group, [this, &src, &workers, slot, slotNodes, slotCounts, slotRegion, cul, clr, cutoff,
+                                  tolerance, depth]() {
+                *slot = BuildNodeParallel(src, cul, clr, workers, *slotNodes, cutoff, tolerance, depth + 1,
+                                          *slotCounts, slotRegion);
+            });
+        }
+    }
+    children[0] = BuildNodeParallel(src, childUL[0], childLR[0], workers, nodes, cutoff,
+                                    tolerance, depth + 1, counts, region ? &childRegions[0] : nullptr);
+    workers.Wait(group);
+
+    for (int i = 1; i < 4; i++) {
+        nodes.Splice(taskNodes[i]);
+        addCounts(counts, taskCounts[i]);
+    }
+
+    if (region) {
+        mergeRegions(src, ul, lr, nodes, tolerance, depth, counts, childRegions, present, childUL, childLR, *region);
+        return region->node;
+    }
+
+    Node* node = nodes.Make(ul, lr, RGBAPixel());
+    countNode(counts, depth, false);
+    node->NW = children[0];
+    node->NE = children[1];
+    node->SW = children[2];
+    node->SE = children[3];
+    node->avg = nodeAverage(node);
+    return node;
+}
+
+/**
+ * BuildNode for a tree built with a merge tolerance: a region whose pixels
+ * are all within tolerance of its average comes back as a single leaf,
+ * just as Prune(tolerance) would leave it.
+ *
+ * A region's average is made from its children's, so they are worked out
+ * first, bottom-up, together with the ranges of their pixels; but nothing
+ * is allocated for a region until its parent is known not to merge. A
+ * region that merges, and everything inside it, is never built, so the
+ * build allocates only the nodes of the final tree.
+ * Nodes are added to counts as they are made, and taken off again if
+ * they go back to the pool.
+ * @param depth depth of the node for (ul, lr)
+ * @param region receives the region's average, sums and pixel ranges, and
+ *               its subtree, or null if it merges, for mergedNode to make
+ */
+void QTree::BuildNodeMerged(const PixelSource& src, pair<unsigned int, unsigned int> ul,
+                            pair<unsigned int, unsigned int> lr, NodePool& nodes, double tolerance,
+                            unsigned int depth, TreeStats& counts, MergedRegion& region) {
+    if (ul == lr) {
+        RGBAPixel pixel = src.At(ul.first, ul.second);
+        region.node = nullptr;
+        region.avg = pixel;
+        region.total = nodes.KeepsSums() ? pixelSums(pixel) : NodeSums();
+        region.bounds.Reset(pixel);
+        return;
+    }
+
+    pair<unsigned int, unsigned int> childUL[4], childLR[4];
+    bool present[4];
+    splitRect(ul, lr, childUL, childLR, present);
+
+    MergedRegion children[4];
+    for (int i = 0; i < 4; i++) {
+        if (!present[i]) continue;
+
+        if (childUL[i] == childLR[i]) {
+            // mergeRegions takes a pixel's bounds from its colour
+            RGBAPixel pixel = src.At(childUL[i].first, childUL[i].second);
+            children[i].node = nullptr;
+            children[i].avg = pixel;
+            children[i].total = nodes.KeepsSums() ? pixelSums(pixel) : NodeSums();
+        } else {
+            BuildNodeMerged(src, childUL[i], childLR[i], nodes, tolerance, depth + 1, counts, children[i]);
+        }
+    }
+    mergeRegions(src, ul, lr, nodes, tolerance, depth, counts, children, present, childUL, childLR, region);
+}
+
+/**
+ * Works out the region (ul, lr) of BuildNodeMerged from its children's:
+ * its average, as nodeAverage would give it, and its pixel ranges. If
+ * every pixel is within tolerance of that average the region merges, and
+ * its children's subtrees go back to nodes; otherwise its node is made
+ * and linked to its children, which are made first if they merged.
+ */
+void QTree::mergeRegions(const PixelSource& src, pair<unsigned int, unsigned int> ul,
+                         pair<unsigned int, unsigned int> lr, NodePool& nodes, double tolerance,
+                         unsigned int depth, TreeStats& counts, const MergedRegion children[4], const bool present[4],
+                         const pair<unsigned int, unsigned int> childUL[4],
+                         const pair<unsigned int, unsigned int> childLR[4], MergedRegion& region) {
+    unsigned long long totalR = 0, totalG = 0, totalB = 0;
+    unsigned long long totalArea = 0;
+    region.total = NodeSums();
+    for (int i = 0; i < 4; i++) {
+        if (!present[i]) continue;
+
+        // the bounds of a single pixel are never filled in
+        const MergedRegion& child = children[i];
+        bool pixel = childUL[i] == childLR[i];
+        if (i == 0) {
+            if (pixel) {
+                region.bounds.Reset(child.avg);
+            } else {
+                region.bounds = child.bounds;
+            }
+        } else if (pixel) {
+            region.bounds.Add(child.avg);
+        } else {
+            region.bounds.Merge(child.bounds);
+        }
+        unsigned long long childArea = static_cast<unsigned long long>(childLR[i].first - childUL[i].first + 1) *
+                                       (childLR[i].second - childUL[i].second + 1);
+        totalR += child.avg.r * childArea;
+        totalG += child.avg.g * childArea;
+        totalB += child.avg.b * childArea;
+        totalArea += childArea;
+        region.total.r += child.total.r;
+        region.total.g += child.total.g;
+        region.total.b += child.total.b;
+        region.total.a += child.total.a;
+    }
+
+    if (nodes.KeepsSums()) {
+        region.avg = sumsAverage(region.total, totalArea);
+    } else {
+        region.avg = RGBAPixel(static_cast<unsigned char>(totalR / totalArea),
+                               static_cast<unsigned char>(totalG / totalArea),
+                               static_cast<unsigned char>(totalB / totalArea));
+    }
+
+    if (regionWithinTolerance(src, ul, lr, region.bounds, region.avg, tolerance)) {
+        for (int i = 0; i < 4; i++) {
+            if (present[i]) {
+                releaseHelper(children[i].node, nodes, depth + 1, counts);
+            }
+        }
+        region.node = nullptr;
+        return;
+    }
+
+    Node* node = nodes.Make(ul, lr, region.avg);
+    countNode(counts, depth, false);
+    if (nodes.KeepsSums()) {
+        NodePool::SumsOf(node) = region.total;
+    }
+    node->NW = mergedNode(children[0], childUL[0], childLR[0], nodes, depth + 1, counts);
+    node->NE = present[1] ? mergedNode(children[1], childUL[1], childLR[1], nodes, depth + 1, counts) : nullptr;
+    node->SW = present[2] ? mergedNode(children[2], childUL[2], childLR[2], nodes, depth + 1, counts) : nullptr;
+    node->SE = present[3] ? mergedNode(children[3], childUL[3], childLR[3], nodes, depth + 1, counts) : nullptr;
+    region.node = node;
+}
+
+/**
+ * The node of a region BuildNodeMerged worked out: its subtree, or, if it
+ * merged, a new leaf holding its average, which is added to counts.
+ */
+Node* QTree::mergedNode(const MergedRegion& region, pair<unsigned int, unsigned int> ul,
+                        pair<unsigned int, unsigned int> lr, NodePool& nodes, unsigned int depth,
+                        TreeStats& counts) const {
+    if (region.node) {
+        return region.node;
+    }
+    Node* leaf = nodes.Make(ul, lr, region.avg);
+    countNode(counts, depth, true);
+    if (nodes.KeepsSums() && ul != lr) {
+        NodePool::SumsOf(leaf) = region.total;
+    }
+    return leaf;
+}
+
+/**
+ * The test Prune applies to the leaves under a node, made on the pixels of
+ * its region: is every one within tolerance of avg? The region's bounds
+ * usually decide, and only when they cannot are its pixels scanned.
+ */
+bool QTree::regionWithinTolerance(const PixelSource& src, pair<unsigned int, unsigned int> ul,
+                                  pair<unsigned int, unsigned int> lr, const RegionBounds& bounds,
+                                  const RGBAPixel& avg, double tolerance) const {
+    bool within;
+    if (bounds.Decides(avg, tolerance, within)) {
+        return within;
+    }
+    return pixelsWithinTolerance(src, ul, lr, avg, tolerance);
+}
+
+/**
+ * A uniform region is settled by any one of its pixels. Otherwise the
+ * bound on the distance over the whole channel range may show that every
+ * pixel passes, and if it does not, the pixels holding the extreme channel
+ * values are tried, as they are the likeliest to fail.
+ */
+bool QTree::RegionBounds::Decides(const RGBAPixel& avg, double tolerance, bool& within) const {
+    bool uniform = true;
+    for (int c = 0; c < 4; c++) {
+        uniform = uniform && low[c] == high[c];
+    }
+
+    // every pixel equals the witnesses
+    if (uniform) {
+        within = RGBAPixel(lowPixel[0].r, lowPixel[0].g, lowPixel[0].b, lowPixel[0].a).distanceTo(avg) <= tolerance;
+        return true;
+    }
+
+    // margin for rounding: the bound is not computed in the order distanceTo uses
+    if (MaxDistanceTo(avg) + 1e-9 <= tolerance) {
+        within = true;
+        return true;
+    }
+
+    for (int c = 0; c < 4; c++) {
+        const Sample& l = lowPixel[c];
+        const Sample& h = highPixel[c];
+        if (RGBAPixel(l.r, l.g, l.b, l.a).distanceTo(avg) > tolerance ||
+            RGBAPixel(h.r, h.g, h.b, h.a).distanceTo(avg) > tolerance) {
+            within = false;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Checks every pixel of the region against avg, stopping at the first
+ * one that is not within tolerance.
+ */
+bool QTree::pixelsWithinTolerance(const PixelSource& src, pair<unsigned int, unsigned int> ul,
+                                  pair<unsigned int, unsigned int> lr, const RGBAPixel& avg,
+                                  double tolerance) const {
+    for (unsigned int y = ul.second; y <= lr.second; y++) {
+        for (unsigned int x = ul.first; x <= lr.first; x++) {
+            if (src.At(x, y).distanceTo(avg) > tolerance) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * clearHelper for nodes that belong to the given pool and are counted in
+ * counts rather than in the tree's stats.
+ */
+void QTree::releaseHelper(Node* node, NodePool& nodes, unsigned int depth, TreeStats& counts) {
+    if (!node) {
+        return;
+    }
+
+    counts.nodes--;
+    counts.depths[depth]--;
+    if (isLeaf(node)) {
+        counts.leaves--;
+    }
+
+    releaseHelper(node->NW, nodes, depth + 1, counts);
+    releaseHelper(node->NE, nodes, depth + 1, counts);
+    releaseHelper(node->SW, nodes, depth + 1, counts);
+    releaseHelper(node->SE, nodes, depth + 1, counts);
+
+    nodes.Release(node);
+}
+
+
+
+/**
+ * Lists how the splitting rule cuts one axis of the image at every depth.
+ * starts[d] holds the first coordinate of each interval at depth d, followed
+ * by length as a sentinel; an interval of length 1 carries over unchanged
+ * to the next depth. firsts[d][i] is the index at depth d + 1 of the first
+ * piece of interval i.
+ * @param length number of pixels along the axis
+ * @param depth deepest level to list; at least the number of halvings
+ *              that reduce length to 1
+ */
+void QTree::splitAxis(unsigned int length, unsigned int depth,
+                      vector<vector<unsigned int> >& starts, vector<vector<unsigned int> >& firsts) {
+    starts.assign(depth + 1, vector<unsigned int>());
+    firsts.assign(depth, vector<unsigned int>());
+
+    starts[0].push_back(0);
+    starts[0].push_back(length);
+
+    for (unsigned int d = 0; d < depth; d++) {
+        const vector<unsigned int>& cur = starts[d];
+        vector<unsigned int>& next = starts[d + 1];
+        for (size_t i = 0; i + 1 < cur.size(); i++) {
+            unsigned int len = cur[i + 1] - cur[i];
+            firsts[d].push_back(next.size());
+            next.push_back(cur[i]);
+            if (len > 1) {
+                // the extra line goes to the left/upper piece
+                next.push_back(cur[i] + (len + 1) / 2);
+            }
+        }
+        next.push_back(length);
+    }
+}
+
+/**
+ * Reduces the averages of every depth's grid from the pixels of src.
+ *
+ * Both axes are split independently of each other, so the nodes at depth d
+ * form a grid: one column per x interval at depth d and one row per y
+ * interval. The deepest grid is the image itself, one cell per pixel, and
+ * is read in row order. Each coarser grid is reduced from the one below it,
+ * one row at a time: a horizontal pass combines the columns of each child
+ * row, weighted by width, and a vertical pass adds the child rows, weighted
+ * by height. Both passes are plain loops over contiguous colour planes,
+ * which the compiler can vectorise. The sums, and so the truncated
+ * averages, are exactly those of calculateAverageColour.
+ */
+void QTree::LevelAverages::Fill(const PixelSource& src) {
+    unsigned int w = src.width;
+    unsigned int h = src.height;
+
+    unsigned int depth = 0;
+    while ((1ull << depth) < w || (1ull << depth) < h) {
+        depth++;
+    }
+
+    splitAxis(w, depth, xStarts, xFirsts);
+    splitAxis(h, depth, yStarts, yFirsts);
+
+    r.assign(depth + 1, vector<unsigned char>());
+    g.assign(depth + 1, vector<unsigned char>());
+    b.assign(depth + 1, vector<unsigned char>());
+
+    // deepest level: the pixels
+    size_t pixels = static_cast<size_t>(w) * h;
+    r[depth].resize(pixels);
+    g[depth].resize(pixels);
+    b[depth].resize(pixels);
+    for (unsigned int y = 0; y < h; y++) {
+        for (unsigned int x = 0; x < w; x++) {
+            size_t i = x + static_cast<size_t>(y) * w;
+            RGBAPixel pixel = src.At(x, y);
+            r[depth][i] = pixel.r;
+            g[depth][i] = pixel.g;
+            b[depth][i] = pixel.b;
+        }
+    }
+
+    for (unsigned int d = depth; d-- > 0;) {
+        const vector<unsigned int>& xs = xStarts[d];
+        const vector<unsigned int>& ys = yStarts[d];
+        const vector<unsigned int>& childXs = xStarts[d + 1];
+        const vector<unsigned int>& childYs = yStarts[d + 1];
+        const vector<unsigned char>& planeR = r[d + 1];
+        const vector<unsigned char>& planeG = g[d + 1];
+        const vector<unsigned char>& planeB = b[d + 1];
+        size_t cols = xs.size() - 1;
+        size_t rows = ys.size() - 1;
+        size_t childCols = childXs.size() - 1;
+
+        // horizontal pass gathers: first piece, second piece (or the first
+        // again) and their widths (0 for a missing second piece)
+        vector<unsigned int> left(cols), right(cols);
+        vector<unsigned long long> leftW(cols), rightW(cols);
+        for (size_t i = 0; i < cols; i++) {
+            unsigned int c = xFirsts[d][i];
+            bool split = xs[i + 1] - xs[i] > 1;
+            left[i] = c;
+            right[i] = split ? c + 1 : c;
+            leftW[i] = childXs[c + 1] - childXs[c];
+            rightW[i] = split ? childXs[c + 2] - childXs[c + 1] : 0;
+        }
+
+        vector<unsigned char>& upR = r[d];
+        vector<unsigned char>& upG = g[d];
+        vector<unsigned char>& upB = b[d];
+        upR.resize(cols * rows);
+        upG.resize(cols * rows);
+        upB.resize(cols * rows);
+        vector<unsigned long long> rowR(cols), rowG(cols), rowB(cols);
+        vector<unsigned long long> sumR(cols), sumG(cols), sumB(cols);
+
+        for (size_t j = 0; j < rows; j++) {
+            unsigned int firstRow = yFirsts[d][j];
+            unsigned int numRows = (ys[j + 1] - ys[j] > 1) ? 2 : 1;
+
+            for (size_t i = 0; i < cols; i++) {
+                sumR[i] = sumG[i] = sumB[i] = 0;
+            }
+
+            for (unsigned int cr = firstRow; cr < firstRow + numRows; cr++) {
+                size_t base = cr * childCols;
+                unsigned long long rowH = childYs[cr + 1] - childYs[cr];
+
+                for (size_t i = 0; i < cols; i++) {
+                    rowR[i] = planeR[base + left[i]] * leftW[i] + planeR[base + right[i]] * rightW[i];
+                    rowG[i] = planeG[base + left[i]] * leftW[i] + planeG[base + right[i]] * rightW[i];
+                    rowB[i] = planeB[base + left[i]] * leftW[i] + planeB[base + right[i]] * rightW[i];
+                }
+                for (size_t i = 0; i < cols; i++) {
+                    sumR[i] += rowR[i] * rowH;
+                    sumG[i] += rowG[i] * rowH;
+                    sumB[i] += rowB[i] * rowH;
+                }
+            }
+
+            for (size_t i = 0; i < cols; i++) {
+                size_t out = j * cols + i;
+                unsigned int area = (xs[i + 1] - xs[i]) * (ys[j + 1] - ys[j]);
+                upR[out] = static_cast<unsigned char>(sumR[i] / area);
+                upG[out] = static_cast<unsigned char>(sumG[i] / area);
+                upB[out] = static_cast<unsigned char>(sumB[i] / area);
+            }
+        }
+    }
+}
+
+/**
+ * The average of the region at the given depth whose upper left corner is
+ * ul, found by binary search in that depth's grid.
+ */
+RGBAPixel QTree::LevelAverages::Average(pair<unsigned int, unsigned int> ul, unsigned int depth) const {
+    const vector<unsigned int>& xs = xStarts[depth];
+    const vector<unsigned int>& ys = yStarts[depth];
+    size_t col = lower_bound(xs.begin(), xs.end(), ul.first) - xs.begin();
+    size_t row = lower_bound(ys.begin(), ys.end(), ul.second) - ys.begin();
+    size_t i = row * (xs.size() - 1) + col;
+    return RGBAPixel(r[depth][i], g[depth][i], b[depth][i]);
+}
+
+/**
+ * Builds the same tree as BuildNode, bottom-up: the averages of every
+ * depth's grid are reduced first, by LevelAverages::Fill, and the nodes
+ * are then made one grid at a time, from the pixels up, each linked to the
+ * cells below it.
+ *
+ * A grid cell whose rectangle is a single pixel is the same leaf as the
+ * cell below it, so it is carried up rather than rebuilt, and it is added
+ * to counts at the depth of the first node made above it.
+ */
+Node* QTree::BuildPyramid(const PixelSource& src, NodePool& nodes, TreeStats& counts) {
+    unsigned int w = src.width;
+    unsigned int h = src.height;
+    if (w == 0 || h == 0) {
+        return nullptr;
+    }
+
+    LevelAverages levels;
+    levels.Fill(src);
+    unsigned int depth = levels.r.size() - 1;
+
+    // deepest level: one leaf per pixel
+    vector<Node*> cells(static_cast<size_t>(w) * h);
+    for (unsigned int y = 0; y < h; y++) {
+        for (unsigned int x = 0; x < w; x++) {
+            cells[x + static_cast<size_t>(y) * w] = nodes.Make(make_pair(x, y), make_pair(x, y), src.At(x, y));
+        }
+    }
+
+    for (unsigned int d = depth; d-- > 0;) {
+        const vector<unsigned int>& xs = levels.xStarts[d];
+        const vector<unsigned int>& ys = levels.yStarts[d];
+        size_t cols = xs.size() - 1;
+        size_t rows = ys.size() - 1;
+        size_t childCols = levels.xStarts[d + 1].size() - 1;
+
+        vector<Node*> up(cols * rows);
+        for (size_t j = 0; j < rows; j++) {
+            bool splitY = ys[j + 1] - ys[j] > 1;
+            for (size_t i = 0; i < cols; i++) {
+                size_t out = j * cols + i;
+                size_t nw = levels.yFirsts[d][j] * childCols + levels.xFirsts[d][i];
+                bool splitX = xs[i + 1] - xs[i] > 1;
+
+                if (!splitX && !splitY) {
+                    up[out] = cells[nw];
+                    continue;
+                }
+
+                pair<unsigned int, unsigned int> ul = make_pair(xs[i], ys[j]);
+                pair<unsigned int, unsigned int> lr = make_pair(xs[i + 1] - 1, ys[j + 1] - 1);
+                Node* node = nodes.Make(ul, lr, RGBAPixel(levels.r[d][out], levels.g[d][out], levels.b[d][out]));
+                node->NW = cells[nw];
+                node->NE = splitX ? cells[nw + 1] : nullptr;
+                node->SW = splitY ? cells[nw + childCols] : nullptr;
+                node->SE = (splitX && splitY) ? cells[nw + childCols + 1] : nullptr;
+                countNode(counts, d, false);
+                Node* children[4] = { node->NW, node->NE, node->SW, node->SE };
+                for (int c = 0; c < 4; c++) {
+                    if (children[c] && children[c]->upLeft == children[c]->lowRight) {
+                        countNode(counts, d + 1, true);
+                    }
+                }
+                if (nodes.KeepsSums()) {
+                    node->avg = nodeAverage(node);
+                }
+                up[out] = node;
+            }
+        }
+        cells.swap(up);
+    }
+
+    if (w == 1 && h == 1) {
+        countNode(counts, 0, true);
+    }
+    return cells[0];
+}
+
+/**
+ * Returns the colour that Render(1) would draw at pixel (x, y), the
+ * average stored in the leaf whose rectangle contains the pixel.
+ * On a lazily built tree, only the regions on the way to that leaf
+ * are built.
+ *
+ * @param x column of the pixel
+ * @param y row of the pixel
+ * @pre (x, y) lies inside the image the tree renders
+ */
+RGBAPixel QTree::ColourAt(unsigned int x, unsigned int y) const {
+    Node* node = root;
+    while (node) {
+        if (isStub(node)) {
+            expandStub(node);
+        }
+
+        Node* children[4] = { node->NW, node->NE, node->SW, node->SE };
+        Node* next = nullptr;
+        for (int i = 0; i < 4 && !next; i++) {
+            Node* child = children[i];
+            if (child && child->upLeft.first <= x && x <= child->lowRight.first &&
+                child->upLeft.second <= y && y <= child->lowRight.second) {
+                next = child;
+            }
+        }
+
+        if (!next) {
+            return node->avg;
+        }
+        node = next;
+    }
+    return RGBAPixel();
+}
+
+/**
+ * BuildNode for a lazy tree: builds the given number of levels of the
+ * subtree for (ul, lr). A region reached with no levels left becomes a
+ * stub, a leaf that already holds the average BuildNode would give it.
+ * Each node is added to the tree's stats as it is made.
+ * @param levels levels still to build, counting this one's children
+ */
+Node* QTree::BuildNodeLazy(const PixelSource& src, pair<unsigned int, unsigned int> ul,
+                           pair<unsigned int, unsigned int> lr, NodePool& nodes, unsigned int levels,
+                           unsigned int depth) const {
+    if (ul == lr) {
+        countNode(stats, depth, true);
+        return nodes.Make(ul, lr, src.At(ul.first, ul.second));
+    }
+
+    if (levels == 0) {
+        // counted as a leaf until it is built
+        countNode(stats, depth, true);
+        Node* stub = nodes.Make(ul, lr, regionAverage(ul, lr, depth));
+        if (sums) {
+            NodePool::SumsOf(stub) = sums->Sums(ul, lr);
+        }
+        stubs[stub] = depth;
+        return stub;
+    }
+
+    Node* node = nodes.Make(ul, lr, RGBAPixel());
+    countNode(stats, depth, false);
+
+    pair<unsigned int, unsigned int> childUL[4], childLR[4];
+    bool present[4];
+    splitRect(ul, lr, childUL, childLR, present);
+
+    node->NW = BuildNodeLazy(src, childUL[0], childLR[0], nodes, levels - 1, depth + 1);
+    node->NE = present[1] ? BuildNodeLazy(src, childUL[1], childLR[1], nodes, levels - 1, depth + 1) : nullptr;
+    node->SW = present[2] ? BuildNodeLazy(src, childUL[2], childLR[2], nodes, levels - 1, depth + 1) : nullptr;
+    node->SE = present[3] ? BuildNodeLazy(src, childUL[3], childLR[3], nodes, levels - 1, depth + 1) : nullptr;
+
+    node->avg = nodeAverage(node);
+    return node;
+}
+
+/**
+ * The average BuildNode computes for the region (ul, lr) at the given
+ * depth, read off the sums or the level averages the tree keeps, so
+ * O(log) however large the region is.
+ */
+RGBAPixel QTree::regionAverage(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                               unsigned int depth) const {
+    if (sums) {
+        unsigned long long area = static_cast<unsigned long long>(lr.first - ul.first + 1) * (lr.second - ul.second + 1);
+        return sumsAverage(sums->Sums(ul, lr), area);
+    }
+    return averages->Average(ul, depth);
+}
+
+/**
+ * The average of an interior node: exact from its children's sums, which
+ * are added up and kept as its own, if the tree has exact averages,
+ * otherwise calculateAverageColour.
+ */
+RGBAPixel QTree::nodeAverage(Node* node) const {
+    if (!nodePool.KeepsSums()) {
+        return calculateAverageColour(node);
+    }
+
+    NodeSums total = NodeSums();
+    Node* children[4] = { node->NW, node->NE, node->SW, node->SE };
+    for (int i = 0; i < 4; i++) {
+        if (children[i]) {
+            NodeSums child = nodeSums(children[i]);
+            total.r += child.r;
+            total.g += child.g;
+            total.b += child.b;
+            total.a += child.a;
+        }
+    }
+    NodePool::SumsOf(node) = total;
+
+    unsigned long long area = static_cast<unsigned long long>(node->lowRight.first - node->upLeft.first + 1) *
+                              (node->lowRight.second - node->upLeft.second + 1);
+    return sumsAverage(total, area);
+}
+
+/**
+ * The sums of a node of a tree with exact averages. A single pixel's are
+ * those of its colour; any larger node keeps its own.
+ */
+NodeSums QTree::nodeSums(const Node* node) const {
+    if (node->upLeft == node->lowRight) {
+        return pixelSums(node->avg);
+    }
+    return NodePool::SumsOf(node);
+}
+
+/**
+ * The sums of a single pixel, with alpha as a byte from 0 to 255.
+ */
+NodeSums QTree::pixelSums(const RGBAPixel& pixel) {
+    unsigned long long alpha = static_cast<unsigned long long>(lround(pixel.a * 255));
+    NodeSums total = { pixel.r * alpha, pixel.g * alpha, pixel.b * alpha, alpha };
+    return total;
+}
+
+/**
+ * The average colour of area pixels with the given sums, as it would be
+ * composited: each channel is weighted by alpha and rounded to the nearest
+ * value, and alpha is the mean alpha. Fully transparent pixels average to
+ * transparent black.
+ */
+RGBAPixel QTree::sumsAverage(const NodeSums& total, unsigned long long area) {
+    if (total.a == 0) {
+        return RGBAPixel(0, 0, 0, 0.0);
+    }
+    return RGBAPixel(static_cast<unsigned char>((2 * total.r + total.a) / (2 * total.a)),
+                     static_cast<unsigned char>((2 * total.g + total.a) / (2 * total.a)),
+                     static_cast<unsigned char>((2 * total.b + total.a) / (2 * total.a)),
+                     total.a / (255.0 * area));
+}
+
+/**
+ * Fills the table from the pixels of src. Entry (x, y) holds, for the
+ * pixels above and to the left of (x, y), the sums of r * a, g * a, b * a
+ * and a, with alpha as a byte a from 0 to 255.
+ */
+void QTree::SumTable::Fill(const PixelSource& src) {
+    columns = static_cast<size_t>(src.width) + 1;
+    totals.assign(4 * columns * (src.height + 1), 0);
+
+    for (unsigned int y = 0; y < src.height; y++) {
+        unsigned long long row[4] = { 0, 0, 0, 0 };
+        const unsigned long long* above = &totals[4 * (y * columns + 1)];
+        unsigned long long* out = &totals[4 * ((y + 1) * columns + 1)];
+
+        for (unsigned int x = 0; x < src.width; x++) {
+            NodeSums pixel = pixelSums(src.At(x, y));
+            row[0] += pixel.r;
+            row[1] += pixel.g;
+            row[2] += pixel.b;
+            row[3] += pixel.a;
+            for (int c = 0; c < 4; c++) {
+                out[4 * x + c] = above[4 * x + c] + row[c];
+            }
+        }
+    }
+}
+
+/**
+ * Sums of r * a, g * a, b * a and a over the rectangle (ul, lr).
+ */
+NodeSums QTree::SumTable::Sums(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const {
+    size_t top = ul.second * columns;
+    size_t bottom = (lr.second + 1) * columns;
+    size_t left = ul.first;
+    size_t right = lr.first + 1;
+
+    unsigned long long out[4];
+    for (int c = 0; c < 4; c++) {
+        out[c] = totals[4 * (bottom + right) + c] - totals[4 * (bottom + left) + c]
+               - totals[4 * (top + right) + c] + totals[4 * (top + left) + c];
+    }
+    NodeSums total = { out[0], out[1], out[2], out[3] };
+    return total;
+}
+
+bool QTree::isStub(const Node* node) const {
+    return !stubs.empty() && stubs.count(node) > 0;
+}
+
+/**
+ * Builds the next lazyDepth levels below a stub, which becomes an
+ * ordinary interior node. Its average is already correct.
+ */
+void QTree::expandStub(Node* node) const {
+    unsigned int depth = stubs[node];
+    stubs.erase(node);
+
+    pair<unsigned int, unsigned int> childUL[4], childLR[4];
+    bool present[4];
+    splitRect(node->upLeft, node->lowRight, childUL, childLR, present);
+
+    node->NW = BuildNodeLazy(source, childUL[0], childLR[0], nodePool, lazyDepth - 1, depth + 1);
+    node->NE = present[1] ? BuildNodeLazy(source, childUL[1], childLR[1], nodePool, lazyDepth - 1, depth + 1) : nullptr;
+    node->SW = present[2] ? BuildNodeLazy(source, childUL[2], childLR[2], nodePool, lazyDepth - 1, depth + 1) : nullptr;
+    node->SE = present[3] ? BuildNodeLazy(source, childUL[3], childLR[3], nodePool, lazyDepth - 1, depth + 1) : nullptr;
+
+    // the stub was counted as a leaf; BuildNodeLazy counted its new subtree
+    stats.leaves--;
+}
+
+/**
+ * Builds every stub in the subtree of node, so the subtree is exactly
+ * what an eager build makes.
+ */
+void QTree::materializeHelper(Node* node) const {
+    if (!node || stubs.empty()) {
+        return;
+    }
+
+    if (isStub(node)) {
+        expandStub(node);
+    }
+
+    materializeHelper(node->NW);
+    materializeHelper(node->NE);
+    materializeHelper(node->SW);
+    materializeHelper(node->SE);
+}
+
+/**
+ * Returns the tree's node and leaf counts, depth histogram and memory
+ * use. These are kept up to date by every call that changes the tree,
+ * so Stats() takes O(1) time (the histogram has one entry per level).
+ * On a lazily built tree, only the nodes built so far are counted,
+ * and a region not yet built counts as a leaf.
+ */
+TreeStats QTree::Stats() const {
+    TreeStats result = stats;
+    while (!result.depths.empty() && result.depths.back() == 0) {
+        result.depths.pop_back();
+    }
+    result.bytes = nodePool.BytesReserved();
+    return result;
+}
+
+/**
+ * Adds a node at the given depth to counts.
+ */
+void QTree::countNode(TreeStats& counts, unsigned int depth, bool leaf) {
+    counts.nodes++;
+    if (counts.depths.size() <= depth) {
+        counts.depths.resize(depth + 1, 0);
+    }
+    counts.depths[depth]++;
+    if (leaf) {
+        counts.leaves++;
+    }
+}
+
+/**
+ * Adds the nodes counted in more to counts.
+ */
+void QTree::addCounts(TreeStats& counts, const TreeStats& more) {
+    counts.nodes += more.nodes;
+    counts.leaves += more.leaves;
+    if (counts.depths.size() < more.depths.size()) {
+        counts.depths.resize(more.depths.size(), 0);
+    }
+    for (size_t d = 0; d < more.depths.size(); d++) {
+        counts.depths[d] += more.depths[d];
+    }
+}
+
+/**
+ * Adds to nodes and leaves what the stubs of a lazy tree add once built.
+ * A stub's region always ends up as the full subtree BuildNode makes,
+ * since Prune builds or collapses every stub it reaches, and the shape of
+ * that subtree depends only on the region's size, so nothing is built.
+ */
+void QTree::unbuiltCounts(unsigned long& nodes, unsigned long& leaves) const {
+    unordered_map<unsigned long long, unsigned long> memo;
+    for (unordered_map<const Node*, unsigned int>::const_iterator it = stubs.begin(); it != stubs.end(); ++it) {
+        const Node* stub = it->first;
+        unsigned int w = stub->lowRight.first - stub->upLeft.first + 1;
+        unsigned int h = stub->lowRight.second - stub->upLeft.second + 1;
+        // the stub itself is already counted, as a leaf
+        nodes += fullNodes(w, h, memo) - 1;
+        leaves += static_cast<unsigned long>(w) * h - 1;
+    }
+}
+
+/**
+ * Nodes in the full subtree of a w x h region. The regions at one depth
+ * come in at most four sizes, so memo keeps this O(depth) per size.
+ */
+unsigned long QTree::fullNodes(unsigned int w, unsigned int h, unordered_map<unsigned long long, unsigned long>& memo) {
+    if (w == 1 && h == 1) {
+        return 1;
+    }
+
+    unsigned long long key = (static_cast<unsigned long long>(w) << 32) | h;
+    unordered_map<unsigned long long, unsigned long>::const_iterator found = memo.find(key);
+    if (found != memo.end()) {
+        return found->second;
+    }
+
+    // the extra column and row go to the western and northern children
+    unsigned int west = w - w / 2, north = h - h / 2;
+    unsigned long count = 1 + fullNodes(west, north, memo);
+    if (w > 1) count += fullNodes(w / 2, north, memo);
+    if (h > 1) count += fullNodes(west, h / 2, memo);
+    if (w > 1 && h > 1) count += fullNodes(w / 2, h / 2, memo);
+
+    memo[key] = count;
+    return count;
+}
+
+
+PrunedView::PrunedView(const QTree& t, double tol) : tree(&t), tolerance(tol) {
+    tree->indexThresholds();
+}
+
+PNG PrunedView::Render(unsigned int scale, unsigned int threads) const {
+    return tree->RenderPruned(tolerance, scale, threads);
+}
+
+bool PrunedView::RenderToFile(const string& fileName, unsigned int scale, unsigned int threads) const {
+    return tree->writeRender(fileName, scale, threads, tolerance);
+}
+
+unsigned int PrunedView::CountNodes() const {
+    unsigned long nodes = 0, leaves = 0;
+    tree->countView(tree->root, tolerance, nodes, leaves);
+    return nodes;
+}
+
+unsigned int PrunedView::CountLeaves() const {
+    unsigned long nodes = 0, leaves = 0;
+    tree->countView(tree->root, tolerance, nodes, leaves);
+    return leaves;
+}
+
+double PrunedView::Tolerance() const {
+    return tolerance;
+}
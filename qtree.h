@@ -9,13 +9,24 @@
 #ifndef _QTREE_H_
 #define _QTREE_H_
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <utility>
 #include "cs221util/PNG.h"
 #include "cs221util/RGBAPixel.h"
+#include "distance.h"
+#include "nodepool.h"
 
 using namespace std;
 using namespace cs221util;
 
+class WorkPool;
+class PrunedView;
+
 /**
  * Like we had for PA1, the Node class *should be* private to the tree
  * class via the principle of encapsulation -- the end user does not
@@ -35,6 +46,34 @@ public:
     Node* SE; // lower-right child
 };
 
+/**
+ * Options controlling how QTree(const PNG&, const BuildOptions&) builds a tree.
+ * With the default mergeTolerance and exactAverages, every combination of
+ * options produces the same tree as QTree(const PNG&). With mergeTolerance
+ * >= 0 they all produce the tree that QTree(const PNG&) followed by
+ * Prune(mergeTolerance) leaves, and the result counts as a pruned tree.
+ * exactAverages changes the averages, but again every combination of the
+ * other options agrees.
+ */
+struct BuildOptions {
+    unsigned int threads = 1;      // threads building the tree, including the caller
+    unsigned long cutoff = 65536;  // regions with fewer pixels are built on a single thread
+    bool pyramid = false;          // build bottom-up from the image rows; single-threaded
+    double mergeTolerance = -1;    // if >= 0, regions Prune would collapse are built as leaves
+    unsigned int lazyDepth = 0;    // if > 0, levels built at a time; deeper ones wait until reached
+    bool exactAverages = false;    // average with exact alpha-weighted sums instead of level by level
+};
+
+/**
+ * Size of a QTree, as returned by QTree::Stats().
+ */
+struct TreeStats {
+    unsigned long nodes = 0;        // nodes in the tree
+    unsigned long leaves = 0;       // nodes with no children
+    vector<unsigned long> depths;   // depths[d] is the number of nodes at depth d; the root is at depth 0
+    size_t bytes = 0;               // memory held for the tree's nodes, including unused pool space
+};
+
 /**
  * QTree: This is a structure used in decomposing an image
  * into rectangular regions.
@@ -69,11 +108,15 @@ public:
 
     /**
      * Counts the number of nodes in the tree
+     * On a lazily built tree, counts those of the whole tree without
+     * building any more of it.
      */
     unsigned int CountNodes() const;
 
     /**
      * Counts the number of leaves in the tree
+     * On a lazily built tree, counts those of the whole tree without
+     * building any more of it.
      */
     unsigned int CountLeaves() const;
 
@@ -117,6 +160,62 @@ public:
      */
     QTree(const PNG& imIn);
 
+    /**
+     * Constructor that builds the same QTree as QTree(const PNG&), with
+     * the given build options.
+     *
+     * With more than one thread, the NW, NE, SW and SE subtrees of every
+     * region of at least options.cutoff pixels are built as separate tasks
+     * on a work-stealing pool. A node's average is still computed from its
+     * children once they are all finished, so the averages are exactly
+     * the ones the sequential build produces.
+     *
+     * With options.pyramid, the tree is instead built bottom-up: the image
+     * is read row by row into the leaves, and each level of the tree is
+     * then reduced from the level below it, a row of nodes at a time.
+     *
+     * With options.exactAverages, every interior node's average is the
+     * exact average of the pixels in its rectangle, weighted by alpha and
+     * rounded once, instead of being truncated at each level from its
+     * children's averages; its alpha is the mean alpha of those pixels
+     * rather than 1. Every node keeps the exact alpha-weighted sums of its
+     * rectangle, added up from its children's as it is built, so these
+     * averages cost O(1) per node (a lazy tree reads the sums of a region
+     * it has not built yet off a table of running sums over the image).
+     * This changes the tree's colours, so the result is no longer the tree
+     * of QTree(const PNG&).
+     *
+     * With options.lazyDepth > 0, only the top lazyDepth levels are built,
+     * and threads and pyramid are ignored. A region below them is kept as
+     * a leaf holding its correct average until Render, Prune, ColourAt or
+     * any other call first reaches it; it then gets its next lazyDepth
+     * levels. Prune never needs to build a region that it cuts off. The
+     * tree reads imIn while it builds, so imIn must outlive the tree and
+     * stay unchanged. Since even const calls may build nodes, a lazy tree
+     * must not be used from several threads at once.
+     *
+     * @param imIn the image to decompose
+     * @param options build options
+     */
+    QTree(const PNG& imIn, const BuildOptions& options);
+
+    /**
+     * Constructor that builds a QTree straight from packed RGBA8 pixels,
+     * without decoding them into a PNG first. Each pixel is 4 bytes, in
+     * R, G, B, A order, and alpha byte a becomes a / 255.0, exactly as in
+     * PNG::readFromFile; so the tree is the one QTree(const PNG&) builds
+     * from the same pixels. The buffer is only read during construction,
+     * unless options.lazyDepth > 0, in which case it is held like imIn is.
+     *
+     * @param rgba first byte of the top row of pixels
+     * @param w width of the image, in pixels
+     * @param h height of the image, in pixels
+     * @param stride distance in bytes between the starts of consecutive rows, at least 4 * w
+     * @param options build options, as for QTree(const PNG&, const BuildOptions&)
+     */
+    QTree(const unsigned char* rgba, unsigned int w, unsigned int h, size_t stride,
+          const BuildOptions& options = BuildOptions());
+
     /**
      * Overloaded assignment operator for QTrees.
      * Part of the Big Three that we must define because the class
@@ -136,10 +235,215 @@ public:
      * For up-scaled images, no color interpolation will be done;
      * each rectangle is fully rendered into a larger rectangular region.
      * 
+     * With more than one thread, the image is split into horizontal bands
+     * that are drawn at the same time. Each pixel is still written by
+     * exactly one leaf, so the result is the same as with one thread.
+     *
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller
+     * @pre scale > 0
+     */
+    PNG Render(unsigned int scale, unsigned int threads = 1) const;
+
+    /**
+     * Draws the tree into an existing image, the way Render draws it into a
+     * new one, with pixel (0, 0) of the render placed at (offsetX, offsetY).
+     * Only the pixels covered by the render are written; anything that
+     * falls outside target is clipped. Nothing is allocated, so a canvas
+     * can be reused across calls, or shared by several trees as an atlas.
+     *
+     * @param target image to draw into
+     * @param offsetX column of target where the render's left edge goes
+     * @param offsetY row of target where the render's top edge goes
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller, as for Render
+     */
+    void RenderInto(PNG& target, unsigned int offsetX, unsigned int offsetY, unsigned int scale,
+                    unsigned int threads = 1) const;
+
+    /**
+     * Renders the part of the tree that covers the rectangle from (x0, y0) to
+     * (x1, y1), inclusive, in the coordinates of Render(1). The result is
+     * the matching crop of Render(scale): (x1 - x0 + 1) * scale pixels wide
+     * and (y1 - y0 + 1) * scale tall. Subtrees whose rectangles miss the
+     * region are skipped without being visited, so the cost depends on the
+     * size of the region and the leaves that cover it, not on the whole tree.
+     * Any part of the region outside the tree's image keeps PNG's default colour.
+     *
+     * @param x0 left column of the region
+     * @param y0 top row of the region
+     * @param x1 right column of the region
+     * @param y1 bottom row of the region
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller, as for Render
+     * @pre x0 <= x1, y0 <= y1, scale > 0
+     */
+    PNG RenderRegion(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1, unsigned int scale,
+                     unsigned int threads = 1) const;
+
+    /**
+     * Renders the tree at each of the given scales in one traversal per
+     * band of rows: a leaf's colour is painted into all of the images at
+     * once. The result is the same as calling Render(scale) for each scale,
+     * in order.
+     *
+     * With one thread there is a single band, so every node is visited once.
+     * With more, the rows of the tree are split into bands as in Render, and
+     * every task walks the tree from the root to draw its band of rows in
+     * all the images; a node that spans several bands is visited by each of
+     * their tasks, though a leaf's rows are still drawn only once.
+     *
+     * @param scales multipliers for each horizontal/vertical dimension, one per image
+     * @param threads threads drawing the images, including the caller
+     * @pre every scale > 0
+     */
+    vector<PNG> RenderScales(const vector<unsigned int>& scales, unsigned int threads = 1) const;
+
+    /**
+     * Renders the tree at the given scale straight into packed RGBA8 pixels,
+     * 4 bytes each in R, G, B, A order, with alpha stored as a * 255,
+     * truncated, exactly as PNG::writeToFile converts it. The bytes are those
+     * writeToFile would hand to lodepng for Render(scale), but no RGBAPixel
+     * image is built and there is no conversion pass.
+     *
+     * @param rgba first byte of the top row; the buffer must hold every row of the render
+     * @param stride distance in bytes between the starts of consecutive rows, at least 4 * width
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller, as for Render
+     * @pre scale > 0
+     */
+    void RenderRGBA8(unsigned char* rgba, size_t stride, unsigned int scale, unsigned int threads = 1) const;
+
+    /**
+     * Renders the tree at the given scale into bytes, replacing its contents,
+     * packed for lodepng::encode. If every leaf, which is every node the
+     * render paints, is opaque the pixels are RGB8, 3 bytes each, and the
+     * result is 3; otherwise they are RGBA8 as in RenderRGBA8, and the
+     * result is 4. Rows are packed with no padding.
+     *
+     * @param bytes receives the pixels
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller, as for Render
+     * @pre scale > 0
+     * @return bytes per pixel: 3 for RGB (LCT_RGB), 4 for RGBA (LCT_RGBA)
+     */
+    unsigned int RenderBytes(vector<unsigned char>& bytes, unsigned int scale, unsigned int threads = 1) const;
+
+    /**
+     * Renders the tree as if every node at depth maxDepth were a leaf, painting
+     * its average over its whole rectangle; the tree below it is never visited.
+     * Otherwise the same as Render.
+     *
+     * @param maxDepth depth of the deepest nodes drawn; the root is at depth 0
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller, as for Render
+     * @pre scale > 0
+     */
+    PNG RenderLOD(unsigned int maxDepth, unsigned int scale = 1, unsigned int threads = 1) const;
+
+    /**
+     * Renders the tree as Render does, but as if PruneTo(tolerance) had been
+     * called first: every node that would collapse is drawn as a leaf, and the
+     * tree below it is never visited, so the cost depends on the leaves of
+     * the result. The tree itself is not changed.
+     *
+     * @param tolerance maximum RGBA distance to qualify for pruning
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller, as for Render
+     * @pre scale > 0
+     */
+    PNG RenderPruned(double tolerance, unsigned int scale = 1, unsigned int threads = 1) const;
+
+    /**
+     * Renders the tree shrunk by an integer factor, straight from the node
+     * averages. Output pixel (X, Y) samples the render at the centre of the
+     * divisor x divisor block it stands for (clamped to the image), and gets
+     * the colour of the shallowest node containing that sample that covers
+     * no other sample, or of the leaf containing it. Nodes are not visited
+     * below that, so the cost is proportional to the output size.
+     *
+     * @param divisor factor the width and height are divided by, rounding up
+     * @pre divisor > 0
+     */
+    PNG RenderDownscaled(unsigned int divisor) const;
+
+    /**
+     * Renders the tree at any output size. The output is scaled independently
+     * along each axis, and output pixel (X, Y) shows the render at the point
+     * under its centre: column floor((X + 1/2) * width / outWidth), and likewise
+     * for rows, computed exactly in integers. Each pixel gets the colour of the
+     * leaf at that point or, where the output is smaller than the render, of
+     * the shallowest node there that covers no other output pixel, so the
+     * detail drawn follows the output density and the tree is not visited
+     * below it. Render(scale) is RenderSize(width * scale, height * scale), and
+     * where the sizes divide evenly, RenderDownscaled(d) is RenderSize(width / d,
+     * height / d).
+     *
+     * @param outWidth width of the output, in pixels
+     * @param outHeight height of the output, in pixels
+     * @param threads threads drawing the image, including the caller, as for Render
+     */
+    PNG RenderSize(unsigned int outWidth, unsigned int outHeight, unsigned int threads = 1) const;
+
+    /**
+     * Writes the tree as a Deep Zoom image: the descriptor name.dzi, and
+     * the tile pyramid beside it, where tile (column, row) of level L is
+     * name_files/L/column_row.png, each tileSize x tileSize except along
+     * the right and bottom edges. Level 0 is the image shrunk to a single
+     * pixel, each level doubles the size of the one before, the level at
+     * scale 1 is Render(1), and the levels after it are Render(2), Render(4),
+     * ... up to maxScale. The descriptor gives the size of the last level.
+     *
+     * Each tile is drawn on its own: levels below scale 1 are sampled from
+     * the node averages as in RenderDownscaled, with the samples of a level
+     * worked out once and shared by its tiles, and the others are rendered
+     * as in RenderRegion, so no image larger than a tile is ever allocated.
+     * A tile's walk from the root only leaves the path to the tile at
+     * nodes outside it, so it costs about the tile's share of the level.
+     * Tiles are drawn and encoded as tasks spread over the given threads.
+     *
+     * @param name path of the descriptor, without ".dzi"; its directory must exist
+     * @param tileSize width and height of a tile
+     * @param maxScale largest upscale written; levels stop at the largest power of two not above it
+     * @param threads threads drawing and encoding tiles, including the caller
+     * @pre tileSize > 0, maxScale > 0
+     * @return false if the descriptor, a directory or a tile could not be written
+     */
+    bool ExportTiles(const string& name, unsigned int tileSize, unsigned int maxScale = 1,
+                     unsigned int threads = 1) const;
+
+    /**
+     * Brings previous, the image left by the last call to RenderIncremental,
+     * up to date by repainting only the parts whose rendering changed
+     * since then: the regions collapsed by Prune, tracked in cells of 32 x 32
+     * pixels of Render(1). The first call renders it in full, as do calls after
+     * FlipHorizontal, RotateCCW or assignment, which change the whole image.
+     * It is also rendered in full if its size does not match the tree.
+     * Afterwards nothing is dirty, so the next call repaints only what
+     * changes after this one.
+     *
+     * @param previous the image to update in place
+     * @param scale the scale previous was rendered at
+     * @param threads threads repainting, including the caller, as for Render
+     * @pre scale > 0
+     */
+    void RenderIncremental(PNG& previous, unsigned int scale = 1, unsigned int threads = 1);
+
+    /**
+     * Saves Render(scale) as a PNG file without building it: the image is
+     * rendered a band of rows at a time, and each band is encoded and written
+     * before the next is drawn. Only one band (about 4MB of pixels) and two
+     * rows of bytes are held at a time, however large the image. As lodepng
+     * would, the file uses a palette if the leaves have at most 256 colours;
+     * otherwise it is RGB if every leaf is opaque, and RGBA if not.
+     *
+     * @param fileName the file to write
      * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing each band, including the caller, as for Render
      * @pre scale > 0
+     * @return false if the tree is empty or the file could not be written
      */
-    PNG Render(unsigned int scale) const;
+    bool RenderToFile(const string& fileName, unsigned int scale = 1, unsigned int threads = 1) const;
 
     /**
      *  Prune function trims subtrees as high as possible in the tree.
@@ -151,11 +455,101 @@ public:
      *
      * You may want a recursive helper function for this one.
      *
+     * Most nodes are settled in O(1) from the channel ranges of their leaves,
+     * merged up from their children. A node those ranges cannot settle has
+     * its leaves walked, so Prune is not linear: at worst it is O(n log n).
+     *
      * @param tolerance maximum RGBA distance to qualify for pruning
      * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
      */
     void Prune(double tolerance);
 
+    /**
+     * Prune, measuring each leaf against the subtree's average with the
+     * colour distance policy Distance instead of distanceTo: one of
+     * MaxAlphaDistance (distanceTo itself), RGBDistance or LumaDistance
+     * from distance.h, or any struct with the same static Prepare,
+     * Distance and MaxDistance functions. The tolerance is in the
+     * policy's units.
+     *
+     * As in Prune, one post-order pass merges the channel ranges of the
+     * prepared colours of each node's leaves from its children's, and
+     * most nodes are settled in O(1) by BoundsDecide: by the policy's
+     * MaxDistance over those ranges, or by the leaves holding their
+     * extremes. Only the rest prepare their leaves side by side and test
+     * them with one batched ColorsWithinTolerance call. A lazy tree is
+     * built in full first.
+     *
+     * @param tolerance maximum distance under Distance to qualify for pruning
+     * @pre as for Prune
+     */
+    template <class Distance>
+    void Prune(double tolerance) {
+        DistanceKernels kernels = { &PrepareColors<Distance>, &ColorsWithinTolerance<Distance>,
+                                    &BoundsDecide<Distance> };
+        pruneWith(tolerance, kernels);
+    }
+
+    /**
+     * Prunes the tree to what Prune(tolerance) leaves, using the smallest
+     * tolerance at which each node collapses. These thresholds are computed
+     * once, by the first call to PruneTo or RenderPruned, from the leaves the
+     * tree has then (building any regions of a lazy tree not built yet), and
+     * are kept by copies. Each later call only visits the nodes it keeps and
+     * the ones it removes.
+     *
+     * Unlike Prune, PruneTo may be called any number of times. A larger
+     * tolerance than before collapses more; regions removed by an earlier
+     * call cannot come back, so a smaller one leaves them as they are.
+     *
+     * @param tolerance maximum RGBA distance to qualify for pruning
+     */
+    void PruneTo(double tolerance);
+
+    /**
+     * Prunes the tree until it has at most maxLeaves leaves, collapsing the
+     * cheapest subtrees first: nodes are taken in increasing order of their
+     * prune threshold, as in PruneTo, from a priority queue, and each is
+     * collapsed unless an earlier one already removed it. Stopping as soon
+     * as the budget is met gives the least error any pruning within it can
+     * have: every tree PruneTo(t) leaves for a smaller t has more leaves.
+     * The thresholds are computed on first use, as for PruneTo.
+     *
+     * @param maxLeaves largest number of leaves wanted; the tree never goes below one
+     * @return the largest threshold of a node collapsed, 0 if none was
+     */
+    double PruneToLeafCount(unsigned long maxLeaves);
+
+    /**
+     * Prunes the tree until its nodes take at most maxBytes bytes, at
+     * sizeof(Node) each, in the same order and with the same guarantee as
+     * PruneToLeafCount.
+     *
+     * @param maxBytes largest memory wanted for the nodes; the tree never goes below one node
+     * @return the largest threshold of a node collapsed, 0 if none was
+     */
+    double PruneToBytes(size_t maxBytes);
+
+    /**
+     * Returns a view of the tree as PruneTo(tolerance) would leave it, without
+     * changing the tree. The view shares this tree's nodes and holds only the
+     * tolerance, so any number of views cost almost nothing. The thresholds
+     * are computed on first use, as for PruneTo.
+     *
+     * @param tolerance maximum RGBA distance to qualify for pruning
+     */
+    PrunedView View(double tolerance) const;
+
+    /**
+     * Returns View(t) for the smallest tolerance t at which the view has at
+     * most maxLeaves leaves, found from the thresholds without changing the
+     * tree. Nodes sharing that threshold all collapse, so the view may have
+     * fewer leaves than PruneToLeafCount(maxLeaves) leaves, never more error.
+     *
+     * @param maxLeaves largest number of leaves wanted; the view never goes below one
+     */
+    PrunedView ViewToLeafCount(unsigned long maxLeaves) const;
+
     /**
      *  FlipHorizontal rearranges the contents of the tree, so that
      *  its rendered image will appear mirrored across a vertical axis.
@@ -191,9 +585,32 @@ public:
      */
     void RotateCCW();
 
+    /**
+     * Returns the colour that Render(1) would draw at pixel (x, y), the
+     * average stored in the leaf whose rectangle contains the pixel.
+     * On a lazily built tree, only the regions on the way to that leaf
+     * are built.
+     *
+     * @param x column of the pixel
+     * @param y row of the pixel
+     * @pre (x, y) lies inside the image the tree renders
+     */
+    RGBAPixel ColourAt(unsigned int x, unsigned int y) const;
+
+    /**
+     * Returns the tree's node and leaf counts, depth histogram and memory
+     * use. These are kept up to date by every call that changes the tree,
+     * so Stats() takes O(1) time (the histogram has one entry per level).
+     * On a lazily built tree, only the nodes built so far are counted,
+     * and a region not yet built counts as a leaf.
+     */
+    TreeStats Stats() const;
+
     /* =============== end of public PA3 FUNCTIONS =========================*/
 
 private:
+    friend class PrunedView;  // draws and counts the tree through its thresholds
+
     /*
      * Private member variables.
      *
@@ -251,4 +668,55 @@ private:
 #include "qtree-private.h"
 };
 
+/**
+ * PrunedView: a QTree as PruneTo(tolerance) would leave it, made by
+ * QTree::View. Every node whose prune threshold is at most the tolerance
+ * counts as a leaf, and nothing below it is visited, so each call costs
+ * time proportional to the view rather than to the whole tree.
+ *
+ * The view shares the tree's nodes. The tree must outlive the view and
+ * must not be changed while the view is in use.
+ */
+class PrunedView {
+public:
+    /**
+     * Views tree as PruneTo(tolerance) would leave it.
+     */
+    PrunedView(const QTree& tree, double tolerance);
+
+    /**
+     * Renders the view, as QTree::Render renders a pruned tree.
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param threads threads drawing the image, including the caller, as for QTree::Render
+     * @pre scale > 0
+     */
+    PNG Render(unsigned int scale, unsigned int threads = 1) const;
+
+    /**
+     * Saves Render(scale) as a PNG file a band at a time, as QTree::RenderToFile does.
+     * @return false if the tree is empty or the file could not be written
+     */
+    bool RenderToFile(const string& fileName, unsigned int scale = 1, unsigned int threads = 1) const;
+
+    /**
+     * Counts the nodes of the view: those of the tree not below a node that
+     * counts as a leaf.
+     */
+    unsigned int CountNodes() const;
+
+    /**
+     * Counts the leaves of the view.
+     */
+    unsigned int CountLeaves() const;
+
+    /**
+     * The tolerance the tree is viewed at.
+     */
+    double Tolerance() const;
+
+private:
+    const QTree* tree;
+    double tolerance;
+};
+
 #endif
@@ -0,0 +1,155 @@
+/**
+ * @file workpool.cpp
+ * @description implementation of WorkPool, a small work-stealing thread pool
+ *              CPSC 221 PA3
+ */
+
+#include "workpool.h"
+
+namespace {
+    // pool and queue index of the worker thread running this code, if any
+    thread_local const WorkPool* currentPool = nullptr;
+    thread_local unsigned int currentIndex = 0;
+}
+
+WorkPool::TaskGroup::TaskGroup() : remaining(0) {
+}
+
+WorkPool::WorkPool(unsigned int threads) : queued(0), stopping(false) {
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    for (unsigned int i = 0; i < threads; i++) {
+        queues.push_back(unique_ptr<Queue>(new Queue()));
+    }
+    for (unsigned int i = 1; i < threads; i++) {
+        workers.push_back(thread(&WorkPool::WorkerLoop, this, i));
+    }
+}
+
+WorkPool::~WorkPool() {
+    {
+        lock_guard<mutex> guard(idleLock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+void WorkPool::Spawn(TaskGroup& group, function<void()> task) {
+    group.remaining++;
+
+    Queue& q = *queues[CurrentIndex()];
+    {
+        lock_guard<mutex> guard(q.lock);
+        Task t;
+        t.run = std::move(task);
+        t.group = &group;
+        q.tasks.push_back(std::move(t));
+    }
+
+    {
+        // counted under idleLock so a worker about to sleep cannot miss it
+        lock_guard<mutex> guard(idleLock);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+void WorkPool::Wait(TaskGroup& group) {
+    unsigned int index = CurrentIndex();
+    while (group.remaining.load() > 0) {
+        if (RunOne(index)) {
+            continue;
+        }
+
+        // the group's last tasks are running elsewhere
+        unique_lock<mutex> guard(idleLock);
+        wake.wait(guard, [this, &group] { return group.remaining.load() == 0 || queued.load() > 0; });
+    }
+
+    if (group.error) {
+        exception_ptr error = group.error;
+        group.error = nullptr;
+        rethrow_exception(error);
+    }
+}
+
+unsigned int WorkPool::Size() const {
+    return queues.size();
+}
+
+void WorkPool::WorkerLoop(unsigned int index) {
+    currentPool = this;
+    currentIndex = index;
+
+    while (true) {
+        if (RunOne(index)) {
+            continue;
+        }
+
+        unique_lock<mutex> guard(idleLock);
+        wake.wait(guard, [this] { return stopping || queued.load() > 0; });
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+bool WorkPool::RunOne(unsigned int index) {
+    Task t;
+    bool found = false;
+
+    // own queue: newest task first
+    {
+        Queue& own = *queues[index];
+        lock_guard<mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            t = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            found = true;
+        }
+    }
+
+    // steal: oldest task of the next non-empty queue
+    for (size_t i = 1; !found && i < queues.size(); i++) {
+        Queue& victim = *queues[(index + i) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            t = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            found = true;
+        }
+    }
+
+    if (!found) {
+        return false;
+    }
+
+    queued--;
+    try {
+        t.run();
+    } catch (...) {
+        lock_guard<mutex> guard(t.group->errorLock);
+        if (!t.group->error) {
+            t.group->error = current_exception();
+        }
+    }
+
+    if (--t.group->remaining == 0) {
+        {
+            // passes through idleLock so a waiter about to sleep cannot miss it
+            lock_guard<mutex> guard(idleLock);
+        }
+        wake.notify_all();
+    }
+    return true;
+}
+
+unsigned int WorkPool::CurrentIndex() const {
+    return (currentPool == this) ? currentIndex : 0;
+}
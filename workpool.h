@@ -0,0 +1,125 @@
+/**
+ * @file workpool.h
+ * @description declaration of WorkPool, a small work-stealing thread pool
+ *              for fork-join style recursion over QTree quadrants
+ *              CPSC 221 PA3
+ */
+
+#ifndef _WORKPOOL_H_
+#define _WORKPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+ * WorkPool: a fixed set of threads that run spawned tasks.
+ *
+ * Every participating thread owns a task queue. A thread pushes and pops
+ * its own tasks at the back (newest first, which keeps recursive work
+ * depth-first and cache-warm), and when its queue is empty it steals the
+ * oldest task from the front of another thread's queue; the oldest task
+ * is usually the largest remaining piece of the recursion.
+ *
+ * The thread that creates the pool takes part as well: it owns queue 0,
+ * and Wait() runs queued tasks before it blocks, so a task can spawn
+ * subtasks and wait for them without deadlocking the pool. A thread with
+ * nothing to run sleeps until a task is queued or its group finishes.
+ */
+class WorkPool {
+public:
+
+    /**
+     * Counts the outstanding tasks of one fork-join step, and keeps the
+     * first exception any of them threw.
+     */
+    class TaskGroup {
+    public:
+        TaskGroup();
+
+    private:
+        friend class WorkPool;
+        atomic<unsigned int> remaining; // tasks spawned into this group that have not finished
+        mutex errorLock;                // guards error
+        exception_ptr error;            // first exception thrown by a task, if any
+    };
+
+    /**
+     * Starts threads - 1 worker threads; the calling thread is the last one.
+     * @param threads total number of threads doing work, at least 1
+     */
+    explicit WorkPool(unsigned int threads);
+
+    /**
+     * Stops and joins the worker threads. All groups must have been waited on.
+     */
+    ~WorkPool();
+
+    /**
+     * Queues a task on the calling thread's queue, to be run by any thread.
+     * @param group the group whose Wait() will cover this task
+     * @param task the work to run
+     */
+    void Spawn(TaskGroup& group, function<void()> task);
+
+    /**
+     * Returns once every task spawned into group has finished, running
+     * queued tasks (of any group) on the calling thread in the meantime.
+     * If a task of the group threw, rethrows the first exception once the
+     * others are done.
+     */
+    void Wait(TaskGroup& group);
+
+    /**
+     * Number of threads doing work, including the creating thread.
+     */
+    unsigned int Size() const;
+
+private:
+    struct Task {
+        function<void()> run;
+        TaskGroup* group;
+    };
+
+    struct Queue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<Queue> > queues; // one per thread; queue 0 belongs to the creating thread
+    vector<thread> workers;
+
+    mutex idleLock;                // guards sleeping workers
+    condition_variable wake;       // signalled when a task is queued, a group finishes or the pool stops
+    atomic<unsigned int> queued;   // tasks sitting in any queue
+    bool stopping;                 // set under idleLock by the destructor
+
+    WorkPool(const WorkPool&) = delete;
+    WorkPool& operator=(const WorkPool&) = delete;
+
+    /**
+     * Main loop of worker thread number index.
+     */
+    void WorkerLoop(unsigned int index);
+
+    /**
+     * Runs one queued task, preferring the given thread's own queue.
+     * @return false if every queue was empty
+     */
+    bool RunOne(unsigned int index);
+
+    /**
+     * Index of the calling thread's queue in this pool.
+     */
+    unsigned int CurrentIndex() const;
+};
+
+#endif